@@ -2,9 +2,16 @@
 #include <fmt/ranges.h>
 #include <fmt/os.h>
 #include "support.hh"
+#include "queuerunner.hh"
+#include "smtp.hh"
+#include "ratelimit.hh"
+#include "latency.hh"
+#include "dkim.hh"
 #include "sqlwriter.hh"
 #include "inja.hpp"
 #include "argparse/argparse.hpp"
+#include <algorithm>
+#include <functional>
 #include <regex>
 #include <signal.h>
 using namespace std;
@@ -111,18 +118,46 @@ std::string humanTimeShort(time_t t)
   return buffer;
 }
 
+/* An SQL expression that gives ids in the same form as getLargeId(): 22
+   base64url characters, the last of which only carries 4 bits. SQLite's
+   random() comes from the same generator as randomblob(). */
+static string sqlLargeId()
+{
+  static const string chars = "'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_'";
+  string ret;
+  for(int n = 0; n < 21; ++n)
+    ret += "substr(" + chars + ", (random() & 63) + 1, 1) || ";
+  return ret + "substr('AQgw', (random() & 3) + 1, 1)";
+}
+
+static QueueRunner* g_queuerunner;
+static void stopQueueRunner(int)
+{
+  if(g_queuerunner)
+    g_queuerunner->stop();
+}
 
 int main(int argc, char** argv)
 {
   signal(SIGPIPE, SIG_IGN); // every TCP application needs this
   argparse::ArgumentParser args("bmailer", "0.0");
   map<string, string> settings;
-  args.add_argument("--smtp-server").help("IP address of SMTP smart host. If empty, no mail will get sent").default_value("").store_into(settings["smtp-server"]);
+  args.add_argument("--smtp-server").help("IP address of SMTP smart host, or a list like '10.0.0.2, 10.0.0.3:587*2' (port and weight are optional). If empty, no mail will get sent").default_value("").store_into(settings["smtp-server"]);
   args.add_argument("--imap-server").help("IMAP server to query").default_value("").store_into(settings["imap-server"]);
   args.add_argument("--imap-user").help("IMAP server to query").default_value("").store_into(settings["imap-user"]);
   args.add_argument("--imap-password").help("IMAP server to query").default_value("").store_into(settings["imap-password"]);
     
+  args.add_argument("--queue-workers").help("Number of parallel SMTP sessions used by 'queue run'").default_value("1").store_into(settings["queue-workers"]);
+  args.add_argument("--status-batch").help("'queue run' records this many deliveries per transaction. After a crash, at most this many mails get sent again").default_value("100").store_into(settings["status-batch"]);
+  args.add_argument("--status-msec").help("'queue run' commits delivery records at least this often, in milliseconds").default_value("1000").store_into(settings["status-msec"]);
+  args.add_argument("--queue-reserved").help("Number of the --queue-workers that only send transactional mail and tests, never bulk").default_value("1").store_into(settings["queue-reserved"]);
+  args.add_argument("--queue-sessions").help("Drive this many SMTP sessions from a single thread in 'queue run', instead of a thread per --queue-workers").default_value("0").store_into(settings["queue-sessions"]);
+  args.add_argument("--queue-lease").help("Seconds a 'queue run' owns the rows it claimed, before another runner may take them over").default_value("300").store_into(settings["queue-lease"]);
   args.add_argument("--sender-email").help("From address of email we send").default_value("").store_into(settings["sender-email"]);
+  args.add_argument("--dkim-key").help("File with the PEM RSA private key to DKIM sign our mail with. If empty, we do not sign").default_value("").store_into(settings["dkim-key"]);
+  args.add_argument("--dkim-domain").help("DKIM signing domain (d=)").default_value("").store_into(settings["dkim-domain"]);
+  args.add_argument("--dkim-selector").help("DKIM selector (s=), the public key lives in DNS at selector._domainkey.domain").default_value("").store_into(settings["dkim-selector"]);
+  args.add_argument("--spool-dir").help("'queue run' writes messages into this Maildir-style pickup directory of a local MTA (tmp/, new/ and env/ for the envelopes), instead of sending them to --smtp-server").default_value("").store_into(settings["spool-dir"]);
   args.add_argument("--save-settings").help("store settings from this command line to the database").flag();
   
   argparse::ArgumentParser channel_command("channel");
@@ -202,6 +237,7 @@ int main(int argc, char** argv)
   msg_send_command.add_description("Send a message to an email address immediately");
   msg_send_command.add_argument("message").help("a message identifier like m2").required();
   msg_send_command.add_argument("destination").help("an email address").required();
+  msg_send_command.add_argument("--queue").help("queue it ahead of any bulk mail, for 'queue run', instead of sending it now").flag();
   msg_command.add_subparser(msg_send_command);
 
   argparse::ArgumentParser msg_launch_command("launch");
@@ -209,6 +245,8 @@ int main(int argc, char** argv)
   msg_launch_command.add_argument("message").help("a message identifier like m2").required();
   msg_launch_command.add_argument("channel").help("a channel identifier like c2").required();
   msg_launch_command.add_argument("subject").help("the message subject").required();
+  msg_launch_command.add_argument("--at").help("local time to start sending, like '2026-10-18 07:00', or '07:00' for the next 07:00. Needs 'queue run --daemon'").default_value("");
+  msg_launch_command.add_argument("--window").help("spread sending evenly over this many minutes").default_value(0).scan<'i', int>();
   msg_command.add_subparser(msg_launch_command);
   
   args.add_subparser(msg_command);
@@ -230,13 +268,22 @@ int main(int argc, char** argv)
 
   argparse::ArgumentParser queue_stats_command("stats");
   queue_stats_command.add_description("List all queued messages");
+  queue_stats_command.add_argument("--latency").help("show how long each SMTP phase took, per launch and smart host").flag();
   queue_command.add_subparser(queue_stats_command);
 
   
   argparse::ArgumentParser queue_run_command("run");
   queue_run_command.add_description("Send all messages in the queue");
+  queue_run_command.add_argument("--daemon").help("keep running, and send newly queued messages as they arrive").flag();
+  queue_run_command.add_argument("--dry-run").help("build every message, but do not send it, and report the CPU time per stage. Leaves the queue as it was").flag();
   queue_command.add_subparser(queue_run_command);
 
+  argparse::ArgumentParser queue_ratelimit_command("ratelimit");
+  queue_ratelimit_command.add_description("Limit the rate at which 'queue run' sends to a domain");
+  queue_ratelimit_command.add_argument("domain").help("a destination domain like gmail.com, or 'default' for all other domains").required();
+  queue_ratelimit_command.add_argument("limit").help("messages per second and burst size, like 2/10. Use 0 to remove the limit").required();
+  queue_command.add_subparser(queue_ratelimit_command);
+
   argparse::ArgumentParser queue_clear_command("clear");
   queue_clear_command.add_description("Clear all unsent messages from the queue");
   queue_command.add_subparser(queue_clear_command);
@@ -283,6 +330,16 @@ int main(int argc, char** argv)
 	  {
 	    {"name", "PRIMARY KEY"}
 	  }
+      },
+      {"queue",
+       {
+	 {"attempts", "DEFAULT 0"},
+	 {"nextAttempt", "DEFAULT 0"},
+	 {"failed", "DEFAULT 0"},
+	 {"leaseOwner", "DEFAULT ''"},
+	 {"leaseExpiry", "DEFAULT 0"},
+	 {"priority", "DEFAULT 2"}
+       }
       }
     }, SQLWFlag::NoTransactions );
 
@@ -304,6 +361,44 @@ int main(int argc, char** argv)
     {
       cout<< "Error during init: "<<e.what()<<endl;
     }
+
+  // every step on its own, so one that fails does not keep the others from happening
+  auto queueInit = [](const string& what, const std::function<void()>& f) {
+    try {
+      f();
+    }
+    catch(std::exception& e) {
+      cout<< "Error during queue init, "<<what<<": "<<e.what()<<endl;
+    }
+  };
+  queueInit("adding columns", [&]() {
+    // makes sure the queue table has all the columns the runner needs, also in older databases
+    string queueId=getLargeId();
+    db.addValue({{"id", queueId}, {"msgId", ""}, {"subject", ""}, {"sent", false}, {"bounced", false},
+		 {"channelId", ""}, {"channelName", ""}, {"destination", ""}, {"userId", ""}, {"timsi", ""},
+		 {"timestamp", time(0)}, {"attempts", 0}, {"nextAttempt", 0}, {"failed", false}, {"lastError", ""},
+		 {"leaseOwner", ""}, {"leaseExpiry", 0}, {"launchId", ""}, {"priority", (int64_t)QueueRunner::Bulk}}, "queue");
+    db.queryT("delete from queue where id=?", {queueId});
+  });
+  queueInit("creating queueprioidx", [&]() {
+    db.queryT("drop index if exists queuedueidx"); // replaced by queueprioidx, which can also do the lanes
+    db.queryT("create index if not exists queueprioidx on queue(sent, failed, priority, nextAttempt)");
+  });
+  queueInit("creating queuemsguseridx (until it exists, launches do not skip subscribers who already had the message)", [&]() {
+    if(!db.queryT("select 1 from sqlite_master where type='index' and name='queuemsguseridx'").empty())
+      return;
+    /* Older databases can have a message queued twice for a user. The copies
+       that were not sent yet can go, keeping the oldest if none was sent. If
+       it was sent twice, that is history, and we leave it to the operator. */
+    db.queryT("delete from queue where rowid in (select rowid from (select rowid, sent, row_number() over (partition by msgId, userId order by sent desc, rowid) n from queue) where n > 1 and sent=0)");
+    int64_t removed = iget(db.queryT("select changes() c")[0], "c");
+    if(removed)
+      cout<<"Removed "<<removed<<" unsent duplicate rows from the queue"<<endl;
+    db.queryT("create unique index queuemsguseridx on queue(msgId, userId)");
+  });
+  queueInit("creating the latency table", [&]() {
+    LatencyRecorder::initTable(db);
+  });
   
   try {
     args.parse_args(argc, argv);
@@ -450,6 +545,15 @@ int main(int argc, char** argv)
       string rowid = msg_send_command.get("message").substr(1);
       string dest = msg_send_command.get("destination");
       auto rows = db.query("select * from msgs where rowid=?", {rowid});
+      if(msg_send_command["--queue"] == true) {
+	// every test send is a 'user' of its own, so the unique index on (msgId, userId) does not skip it
+	db.addValue({{"id", getLargeId()}, {"msgId", rows.at(0)["id"]}, {"launchId", ""}, {"subject", "test email"}, {"sent", false}, {"bounced", false},
+		     {"channelId", ""}, {"channelName", "NA"}, {"destination", dest}, {"userId", getLargeId()}, {"timsi", "NA"},
+		     {"timestamp", time(0)}, {"attempts", 0}, {"nextAttempt", time(0)}, {"failed", false}, {"lastError", ""},
+		     {"leaseOwner", ""}, {"leaseExpiry", 0}, {"priority", (int64_t)QueueRunner::Test}}, "queue");
+	cout<<"Queued "<<rows[0]["id"]<<" for "<<dest<<endl;
+	return EXIT_SUCCESS;
+      }
 
       nlohmann::json data = nlohmann::json::object();
       inja::Environment e;
@@ -465,18 +569,20 @@ int main(int argc, char** argv)
       fmt::print("Should send {} to {}: {}\n", rows[0]["id"], dest, textmsg);
 
       auto attrows= db.query("select * from attachments where msgId=?", {rows[0]["id"]});
-      vector<pair<string,string>> att;
+      vector<MailAttachment> att;
       for(auto& r : attrows)
-	att.push_back({r["id"], r["filename"]});
+	att.emplace_back(r["id"], r["filename"]);
             
-      sendEmail(settings["smtp-server"],  // system setting
-		"bert@hubertnet.nl", // channel setting really
-		dest,        
-		"test email", // subject
-		textmsg,
-		htmlmsg,
-		"",
-		"bmailer+"+getLargeId()+"@hubertnet.nl", att);
+      SMTPSession session(settings["smtp-server"]);  // system setting
+      if(!settings["dkim-key"].empty())
+	session.setDKIM(std::make_shared<DKIMSigner>(settings["dkim-domain"], settings["dkim-selector"], getContentsOfFile(settings["dkim-key"])));
+      session.sendEmail("bert@hubertnet.nl", // channel setting really
+			dest,        
+			"test email", // subject
+			textmsg,
+			htmlmsg,
+			"",
+			"bmailer+"+getLargeId()+"@hubertnet.nl", att);
     }
     else if(msg_command.is_subcommand_used(msg_launch_command)) {
       // launch m1 c2 "Welkom"
@@ -494,37 +600,35 @@ int main(int argc, char** argv)
 	cout <<"No such channel c"<<msgId<<endl;
 	return EXIT_FAILURE;
       }
+      time_t now = time(0), notBefore = now;
+      if(!msg_launch_command.get("--at").empty())
+	notBefore = parseLocalTime(msg_launch_command.get("--at"), now);
+      int64_t window = 60 * std::max(0, msg_launch_command.get<int>("--window"));
       cout<<"Going to launch to c"<<channelId<<": "<<eget(channel[0], "name")<<endl;
       
-      auto dests = db.queryT("select users.id userId, users.timsi timsi, channels.id channelId, users.email from users,subscriptions,channels where users.id=subscriptions.userId and subscriptions.channelId=channels.id and channels.rowid=?", {channelId});
-
-      for(auto& d: dests) {
-
-	string msgId=eget(msg[0], "id");
-	string userId=eget(d, "userId");
-	auto seen=db.queryT("select id from queue where msgId=? and userId=?", {msgId, userId});
-	if(!seen.empty()) {
-	  cout<<"Skipping message to "<<eget(d,"email")<<", sent them a copy already perhaps on another list"<<endl;
-	  continue;
-	}
-	else
-	  cout<<"Queued to "<<eget(d,"email")<< " with subject " <<subject<<endl;	
-	
-	db.addValue({
-	    {"id", getLargeId()},
-	    {"msgId", msgId},
-	    {"subject", subject},
-	    {"sent", false},
-	    {"bounced", false},
-	    {"channelId", eget(d, "channelId")},
-	    {"channelName", eget(channel[0], "name")},
-	    {"destination", eget(d, "email")},
-	    {"userId", eget(d, "userId")},
-	    {"timsi", eget(d, "timsi")},
-	    {"timestamp", time(0)}
-	  }, "queue");
+      string launchId = getLargeId();
+      string id = eget(msg[0], "id");
+      // a user might already have had this message through another channel, the unique index on (msgId, userId) skips them
+      db.queryT("begin");
+      try {
+	int64_t subscribers = iget(db.queryT("select count(1) c from users, subscriptions, channels where users.id=subscriptions.userId and subscriptions.channelId=channels.id and channels.rowid=?", {channelId})[0], "c");
+	// the n-th subscriber is due n/subscribers of the way into the window. nextAttempt is all the runner looks at, the launch remembers the window
+	db.queryT("insert or ignore into queue (id, msgId, launchId, subject, sent, bounced, channelId, channelName, destination, userId, timsi, timestamp, attempts, nextAttempt, failed, lastError, leaseOwner, leaseExpiry, priority) "
+		  "select " + sqlLargeId() + ", ?, ?, ?, 0, 0, channels.id, channels.name, users.email, users.id, users.timsi, ?, 0, ? + (row_number() over (order by users.rowid) - 1) * ? / ?, 0, '', '', 0, ? "
+		  "from users, subscriptions, channels where users.id=subscriptions.userId and subscriptions.channelId=channels.id and channels.rowid=?",
+		  {id, launchId, subject, (int64_t)now, (int64_t)notBefore, window, std::max(subscribers, (int64_t)1), (int64_t)QueueRunner::Bulk, channelId});
+	int64_t queued = iget(db.queryT("select changes() c")[0], "c");
+	db.addValue({{"id", launchId}, {"channelId", eget(channel[0], "id")}, {"msgId", id}, {"timestamp", (int64_t)now}, {"subject", subject},
+		     {"notBefore", (int64_t)notBefore}, {"window", window}}, "launches");
+	db.queryT("commit");
+	cout<<"Queued "<<queued<<" messages with subject "<<subject<<", skipped "<<subscribers - queued<<" subscribers who had this message already"<<endl;
+	if(notBefore > now || window)
+	  cout<<"Sending starts at "<<humanTimeShort(notBefore)<<" and is spread over "<<window / 60<<" minutes"<<endl;
+      }
+      catch(...) {
+	db.queryT("rollback");
+	throw;
       }
-      db.addValue({{"channelId", eget(channel[0], "id")}, {"msgId", eget(msg[0], "id")}, {"timestamp", time(0)}, {"subject", subject}}, "launches");
     }
     else 
       cout<<msg_command<<endl;
@@ -570,64 +674,89 @@ int main(int argc, char** argv)
     if(queue_command.is_subcommand_used(queue_list_command) || queue_command.is_subcommand_used(queue_ls_command)) {
       auto queued = db.queryT("select * from queue where sent=0");
       for(auto& q: queued) {
-	cout << "Should send to "<<eget(q, "destination") << endl;
+	if(iget(q, "failed"))
+	  cout << "Failed to send to "<<eget(q, "destination") << " after "<< iget(q, "attempts")<<" attempt(s): "<<eget(q, "lastError") << endl;
+	else if(iget(q, "attempts"))
+	  cout << "Should send to "<<eget(q, "destination") << ", attempt "<< iget(q, "attempts")+1 << " at "<< humanTimeShort(iget(q, "nextAttempt"))<<", last error: "<<eget(q, "lastError") << endl;
+	else if(iget(q, "nextAttempt") > time(0))
+	  cout << "Should send to "<<eget(q, "destination") << " at "<< humanTimeShort(iget(q, "nextAttempt")) << endl;
+	else
+	  cout << "Should send to "<<eget(q, "destination") << endl;
       }
     }
     else if(queue_command.is_subcommand_used(queue_stats_command)) {
-      auto s = db.queryT("select count(1) filter (where sent=1) sent, count(1) filter (where bounced=1) bounced, count(1) filter (where sent=0) unsent from queue");
+      auto s = db.queryT("select count(1) filter (where sent=1) sent, count(1) filter (where bounced=1) bounced, count(1) filter (where sent=0 and failed=0) unsent, count(1) filter (where sent=0 and failed=0 and attempts > 0) retrying, count(1) filter (where sent=0 and failed=0 and attempts=0 and nextAttempt > ?) scheduled, count(1) filter (where failed=1) failed from queue", {(int64_t)time(0)});
       cout << "Sent messages: "<< iget(s[0], "sent") << endl;
       cout << "Unsent messages: "<< iget(s[0], "unsent") << endl;
+      cout << "Of which waiting for a retry: "<< iget(s[0], "retrying") << endl;
+      cout << "Of which scheduled for later: "<< iget(s[0], "scheduled") << endl;
+      cout << "Failed permanently: "<< iget(s[0], "failed") << endl;
       cout << "Bounced: "<< iget(s[0], "bounced") << endl;
+      for(auto& r : db.queryT("select name, value from settings where name like 'ratelimit-%'"))
+	cout << "Rate limit for "<< eget(r, "name").substr(10) << ": "<< eget(r, "value") << endl;
+
+      if(queue_stats_command["--latency"] == true) {
+	// launchId, relay -> phase -> histogram, in the order the phases happen
+	map<pair<string,string>, map<int, pair<string, LatencyHistogram>>> hists;
+	for(auto& r : db.queryT("select launchId, relay, phase, bucket, count from latency")) {
+	  string phase = eget(r, "phase");
+	  int order = find(begin(SMTPTimings::names), end(SMTPTimings::names), phase) - begin(SMTPTimings::names);
+	  auto& h = hists[{eget(r, "launchId"), eget(r, "relay")}][order];
+	  h.first = phase;
+	  h.second.addBucket(iget(r, "bucket"), iget(r, "count"));
+	}
+	auto fmtusec = [](double usec) { return usec < 1000 ? fmt::format("{}us", usec) : fmt::format("{}ms", usec / 1000); };
+	for(const auto& [key, phases] : hists) {
+	  auto launch = db.queryT("select timestamp, subject from launches where id=?", {key.first});
+	  if(launch.empty())
+	    cout << "\nNo launch, ";
+	  else
+	    cout << "\nLaunch of "<< humanTimeShort(iget(launch[0], "timestamp")) << " '"<<eget(launch[0], "subject") << "', ";
+	  cout << "smart host "<<key.second<<endl;
+	  for(const auto& [order, h] : phases)
+	    fmt::print("  {:<8} {:>8} samples, p50 < {:<8} p90 < {:<8} p99 < {}\n", h.first, h.second.getCount(),
+		       fmtusec(h.second.getPercentile(0.5)), fmtusec(h.second.getPercentile(0.9)), fmtusec(h.second.getPercentile(0.99)));
+	}
+      }
       
     }
+    else if(queue_command.is_subcommand_used(queue_ratelimit_command)) {
+      string name = "ratelimit-" + getDomain(queue_ratelimit_command.get("domain"));
+      string limit = queue_ratelimit_command.get("limit");
+      if(atof(limit.c_str()) <= 0) {
+	db.queryT("delete from settings where name=?", {name});
+	cout<<"Removed "<<name<<endl;
+      }
+      else {
+	db.addOrReplaceValue({{"name", name}, {"value", limit}}, "settings");
+	cout<<"Set "<<name<<" to "<<limit<<endl;
+      }
+    }
     else if(queue_command.is_subcommand_used(queue_clear_command)) {
       db.queryT("delete from queue where sent=0");
     }
     else if(queue_command.is_subcommand_used(queue_run_command)) {
-      auto queued = db.queryT("select queue.id queueId, msgId, channelId, channelName, timsi, userId, destination, subject, textversion, htmlversion from queue,msgs where sent=0 and msgs.id=queue.msgId");
-
-      for(auto& q: queued) {
-	inja::Environment e;
-	e.set_html_autoescape(false); // NOTE WELL!
-	nlohmann::json data;
-	data["weblink"] = "https://berthub.eu/ckmailer/msg/"+eget(q, "msgId");
-	data["unsubscribelink"] = "https://berthub.eu/ckmailer/manage.html?timsi="+eget(q, "timsi");
-	data["channelName"] = eget(q, "channelName");
-	data["channelLink"] = "https://berthub.eu/ckmailer/channel.html?channelId="+eget(q, "channelId");
-
-	string textmsg = e.render(eget(q, "textversion"), data);
-	e.set_html_autoescape(true); // NOTE WELL!
-	string htmlmsg = e.render(eget(q, "htmlversion"), data);
-
-	auto attrows= db.query("select * from attachments where msgId=?", {eget(q, "msgId")});
-	vector<pair<string,string>> att;
-	for(auto& r : attrows)
-	  att.push_back({r["id"], r["filename"]});
-	cout<<"Sending to "<< eget(q, "destination") <<endl;
-	try {
-	  vector<pair<string,string>> headers = {
-	    {"List-Unsubscribe", "<https://berthub.eu/ckmailer/unsubscribe/"+eget(q, "userId")+"/"+eget(q, "channelId")+">, <mailto:bmailer+"+eget(q, "queueId")+"@hubertnet.nl?subject="+eget(q, "userId")+"/"+eget(q, "channelId")+">"},
-	    {"List-Unsubscribe-Post", "List-Unsubscribe=One-Click"},
-	    {"List-ID", eget(q, "channelName") + " <"+eget(q, "channelId")+">"}
-	  };
-	  
-	  if(1)
-	    sendEmail(settings["smtp-server"],  // system setting
-		      settings["sender-email"], // channel setting really
-		      eget(q, "destination"),        
-		      eget(q, "subject"), // subject
-		      textmsg,
-		      htmlmsg,
-		      "",
-		      "bmailer+"+ eget(q, "queueId") +"@hubertnet.nl", att, headers);
-	  
-	  db.queryT("update queue set sent=1 where id=?", {eget(q, "queueId")});
-	  sleep(1);
-	}
-	catch(std::exception& e) {
-	  fmt::print("Failed to send message to {} : {}\n", eget(q, "destination"), e.what());
-	}
-      }
+      QueueRunnerSettings qrs;
+      qrs.smtpServer = settings["smtp-server"];
+      qrs.spoolDir = settings["spool-dir"];
+      qrs.senderEmail = settings["sender-email"];
+      qrs.dkimKey = settings["dkim-key"];
+      qrs.dkimDomain = settings["dkim-domain"];
+      qrs.dkimSelector = settings["dkim-selector"];
+      qrs.numWorkers = atoi(settings["queue-workers"].c_str());
+      qrs.statusBatch = atoi(settings["status-batch"].c_str());
+      qrs.statusMsec = atoi(settings["status-msec"].c_str());
+      qrs.leaseTime = std::max(4, atoi(settings["queue-lease"].c_str()));
+      qrs.reservedWorkers = std::max(0, atoi(settings["queue-reserved"].c_str()));
+      qrs.sessions = std::max(0, atoi(settings["queue-sessions"].c_str()));
+      qrs.daemon = queue_run_command["--daemon"] == true;
+      qrs.dryRun = queue_run_command["--dry-run"] == true;
+      QueueRunner qr(db, qrs);
+      g_queuerunner = &qr;
+      signal(SIGINT, stopQueueRunner);
+      signal(SIGTERM, stopQueueRunner);
+      qr.run();
+      g_queuerunner = nullptr;
     }
     else {
       cout<<queue_command<<endl;
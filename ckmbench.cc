@@ -0,0 +1,152 @@
+#include <fmt/core.h>
+#include <chrono>
+#include <iostream>
+#include <signal.h>
+#include <unistd.h>
+#include "support.hh"
+#include "queuerunner.hh"
+#include "smtpsink.hh"
+#include "smtp.hh"
+#include "latency.hh"
+#include "sqlwriter.hh"
+#include "argparse/argparse.hpp"
+
+using namespace std;
+
+/* Measures how fast 'queue run' is, without a network or a real relay. We make
+   a fresh database with a newsletter and lots of subscribers in the queue, and
+   send it all to an SMTPSink in this same process. */
+int main(int argc, char** argv)
+{
+  signal(SIGPIPE, SIG_IGN); // every TCP application needs this
+
+  argparse::ArgumentParser args("ckmbench", "0.0");
+  args.add_argument("--subscribers").help("number of mails to queue").default_value(10000).scan<'i', int>();
+  args.add_argument("--domains").help("number of destination domains").default_value(20).scan<'i', int>();
+  args.add_argument("--workers").help("number of parallel SMTP sessions").default_value(4).scan<'i', int>();
+  args.add_argument("--html-kb").help("size of the html part").default_value(50).scan<'i', int>();
+  args.add_argument("--image-kb").help("size of the inline image").default_value(100).scan<'i', int>();
+  args.add_argument("--sessions").help("drive this many sessions from one thread, instead of --workers threads").default_value(0).scan<'i', int>();
+  args.add_argument("--latency-msec").help("sink waits this long before sending replies").default_value(0).scan<'i', int>();
+  args.add_argument("--no-pipelining").help("sink does not announce PIPELINING").flag();
+  args.add_argument("--temp-fail").help("fraction of recipients the sink gives a 451").default_value(0.0).scan<'g', double>();
+  args.add_argument("--perm-fail").help("fraction of recipients the sink gives a 550").default_value(0.0).scan<'g', double>();
+  args.add_argument("--dkim-key").help("DKIM sign with the RSA private key in this PEM file").default_value("");
+  args.add_argument("--keep").help("do not remove the database afterwards").flag();
+
+  try {
+    args.parse_args(argc, argv);
+  }
+  catch (const std::runtime_error& err) {
+    std::cout << err.what() << std::endl << args;
+    std::exit(1);
+  }
+
+  SMTPSinkSettings ss;
+  ss.pipelining = args["--no-pipelining"] == false;
+  ss.latencyMsec = args.get<int>("--latency-msec");
+  ss.tempFail = args.get<double>("--temp-fail");
+  ss.permFail = args.get<double>("--perm-fail");
+  SMTPSink sink(ComboAddress("127.0.0.1", 0), ss);
+  sink.start();
+
+  string id = getLargeId();
+  string dbname = "/tmp/ckmbench-"+id+".sqlite3", imgname = "/tmp/ckmbench-"+id+".png";
+
+  using clock = std::chrono::steady_clock;
+  auto seconds = [](clock::time_point a) { return std::chrono::duration<double>(clock::now() - a).count(); };
+  {
+    SQLiteWriter db(dbname, {
+	{"queue",
+	 {
+	   {"attempts", "DEFAULT 0"},
+	   {"nextAttempt", "DEFAULT 0"},
+	   {"failed", "DEFAULT 0"},
+	   {"leaseOwner", "DEFAULT ''"},
+	   {"leaseExpiry", "DEFAULT 0"},
+	   {"priority", "DEFAULT 2"}
+	 }
+	}
+      }, SQLWFlag::NoTransactions);
+
+    // a newsletter with the same template variables as the real thing
+    string para = "Dit is een alinea met wat tekst, zoals een nieuwsbrief die heeft. It has some links, "
+      "like https://berthub.eu/articles/, and some accents: caf\xc3\xa9, na\xc3\xafve. Also a = sign.\n\n";
+    string text, html;
+    while(html.size() < (size_t)args.get<int>("--html-kb") * 1000) {
+      text += para;
+      html += "<p>" + para + "</p>\n";
+    }
+    text += "Unsubscribe: {{ unsubscribelink }}\nWeb version: {{ weblink }}\n";
+    html += "<img src=\"cid:image1\">\n<p><a href=\"{{ unsubscribelink }}\">Unsubscribe from {{ channelName }}</a></p>\n";
+
+    string img;
+    for(int n = 0; n < args.get<int>("--image-kb") * 125; ++n) {
+      uint64_t r = getRandom64();
+      img.append((char*)&r, sizeof(r));
+    }
+    {
+      FILE* fp = fopen(imgname.c_str(), "w");
+      if(!fp || fwrite(img.c_str(), 1, img.size(), fp) != img.size())
+	throw std::runtime_error("Could not write "+imgname);
+      fclose(fp);
+    }
+
+    string msgId = getLargeId(), channelId = getLargeId();
+    db.addValue({{"id", msgId}, {"markdown", text}, {"textversion", text}, {"htmlversion", html}, {"webversion", html}}, "msgs");
+    db.addValue({{"id", "image1"}, {"msgId", msgId}, {"filename", imgname}}, "attachments");
+    db.addValue({{"name", "bench"}, {"value", "1"}}, "settings");
+    LatencyRecorder::initTable(db);
+
+    auto start = clock::now();
+    int subscribers = args.get<int>("--subscribers"), domains = std::max(1, args.get<int>("--domains"));
+    db.queryT("begin");
+    for(int n = 0; n < subscribers; ++n) {
+      db.addValue({{"id", getLargeId()}, {"msgId", msgId}, {"launchId", "bench"}, {"subject", "Benchmark newsletter"}, {"sent", false}, {"bounced", false},
+		   {"channelId", channelId}, {"channelName", "bench"}, {"destination", fmt::format("user{}@bench{}.example", n, n % domains)},
+		   {"userId", getLargeId()}, {"timsi", getLargeId()}, {"timestamp", time(0)}, {"attempts", 0}, {"nextAttempt", time(0)},
+		   {"failed", false}, {"lastError", ""}, {"leaseOwner", ""}, {"leaseExpiry", 0}, {"priority", (int64_t)QueueRunner::Bulk}}, "queue");
+    }
+    db.queryT("commit");
+    fmt::print("Queued {} mails in {:.2f} s\n", subscribers, seconds(start));
+
+    QueueRunnerSettings qrs;
+    qrs.smtpServer = sink.getLocal().toStringWithPort();
+    qrs.senderEmail = "bench@hubertnet.nl";
+    qrs.numWorkers = args.get<int>("--workers");
+    qrs.sessions = args.get<int>("--sessions");
+    qrs.verbose = false;
+    qrs.dkimKey = args.get("--dkim-key");
+    qrs.dkimDomain = "hubertnet.nl";
+    qrs.dkimSelector = "bench";
+    QueueRunner qr(db, qrs);
+
+    start = clock::now();
+    qr.run();
+    double took = seconds(start);
+
+    auto res = db.queryT("select sum(sent) sent, sum(failed) failed, count(1) c from queue");
+    fmt::print("\nSent {} mails in {:.2f} s, {:.1f} mails/s, {:.1f} MB/s. {} failed for good, {} to retry\n",
+	       sink.getNumMessages(), took, sink.getNumMessages() / took, sink.getNumBytes() / took / 1000000,
+	       iget(res[0], "failed"), iget(res[0], "c") - iget(res[0], "sent") - iget(res[0], "failed"));
+    fmt::print("Per phase, as seen by the sink:\n");
+    for(const auto& [phase, p] : sink.getPhaseStats())
+      fmt::print("  {:<9} p50 {:.2f} ms, p90 {:.2f} ms, p99 {:.2f} ms, max {:.2f} ms ({} samples)\n", phase, p[0], p[1], p[2], p[3], p[4]);
+
+    fmt::print("Per phase, as seen by the runner:\n");
+    for(const auto& phase : SMTPTimings::names) {
+      LatencyHistogram h;
+      for(auto& r : db.queryT("select bucket, count from latency where phase=?", {string(phase)}))
+	h.addBucket(iget(r, "bucket"), iget(r, "count"));
+      if(h.getCount())
+	fmt::print("  {:<9} p50 < {:.2f} ms, p90 < {:.2f} ms, p99 < {:.2f} ms ({} samples)\n", phase,
+		   h.getPercentile(0.5) / 1000, h.getPercentile(0.9) / 1000, h.getPercentile(0.99) / 1000, h.getCount());
+    }
+  }
+  if(args["--keep"] == true)
+    fmt::print("Database left in {}\n", dbname);
+  else {
+    unlink(dbname.c_str());
+    unlink(imgname.c_str());
+  }
+}
@@ -0,0 +1,50 @@
+#include <fmt/core.h>
+#include <iostream>
+#include <signal.h>
+#include <thread>
+#include "smtpsink.hh"
+#include "argparse/argparse.hpp"
+
+using namespace std;
+
+// a fake smart host, so you can point 'ckm queue run' at it and see how fast it goes
+int main(int argc, char** argv)
+{
+  signal(SIGPIPE, SIG_IGN); // every TCP application needs this
+
+  argparse::ArgumentParser args("ckmsink", "0.0");
+  args.add_argument("--listen").help("address to listen on").default_value("127.0.0.1:2525");
+  args.add_argument("--no-pipelining").help("do not announce PIPELINING").flag();
+  args.add_argument("--latency-msec").help("wait this long before sending replies").default_value(0).scan<'i', int>();
+  args.add_argument("--temp-fail").help("fraction of recipients that get a 451").default_value(0.0).scan<'g', double>();
+  args.add_argument("--perm-fail").help("fraction of recipients that get a 550").default_value(0.0).scan<'g', double>();
+  args.add_argument("--fail-after-data").help("reject messages at the final dot, instead of at RCPT").flag();
+
+  try {
+    args.parse_args(argc, argv);
+  }
+  catch (const std::runtime_error& err) {
+    std::cout << err.what() << std::endl << args;
+    std::exit(1);
+  }
+
+  SMTPSinkSettings ss;
+  ss.pipelining = args["--no-pipelining"] == false;
+  ss.latencyMsec = args.get<int>("--latency-msec");
+  ss.tempFail = args.get<double>("--temp-fail");
+  ss.permFail = args.get<double>("--perm-fail");
+  ss.failAfterData = args["--fail-after-data"] == true;
+
+  SMTPSink sink(ComboAddress(args.get<string>("--listen"), 25), ss);
+  sink.start();
+  fmt::print("Listening on {}\n", sink.getLocal().toStringWithPort());
+
+  for(uint64_t last = 0;;) {
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+    uint64_t now = sink.getNumMessages();
+    fmt::print("{} messages ({}/s), {} MB, {} rejected\n", now, (now - last) / 10.0, sink.getNumBytes() / 1000000.0, sink.getNumRejected());
+    last = now;
+    for(const auto& [phase, p] : sink.getPhaseStats())
+      fmt::print("  {:<9} p50 {:.2f} ms, p90 {:.2f} ms, p99 {:.2f} ms, max {:.2f} ms\n", phase, p[0], p[1], p[2], p[3]);
+  }
+}
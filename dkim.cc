@@ -0,0 +1,217 @@
+#include "dkim.hh"
+#include <fmt/format.h>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include "base64.hpp"
+
+using namespace std;
+
+static std::string getOpenSSLError()
+{
+  char buf[256] = "unknown error";
+  if(auto err = ERR_get_error())
+    ERR_error_string_n(err, buf, sizeof(buf));
+  ERR_clear_error();
+  return buf;
+}
+
+namespace {
+/* Simple body canonicalization: the body goes in as it is, except that empty
+   lines at the end are dropped, and it ends on a single \r\n. So we hold back
+   line endings at the end of what we got, until we know if something else
+   follows them. */
+class BodyHasher
+{
+public:
+  BodyHasher() : d_ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free)
+  {
+    if(!d_ctx || EVP_DigestInit_ex(d_ctx.get(), EVP_sha256(), nullptr) != 1)
+      throw std::runtime_error("Could not set up SHA-256: "+getOpenSSLError());
+  }
+  void update(std::string_view data)
+  {
+    size_t end = data.find_last_not_of("\r\n");
+    if(end == string_view::npos) {
+      d_held.append(data);
+      return;
+    }
+    if(!d_held.empty()) {
+      hash(d_held);
+      d_held.clear();
+    }
+    hash(data.substr(0, end + 1));
+    d_held.assign(data.substr(end + 1));
+  }
+  //! base64 of the hash
+  std::string final()
+  {
+    hash("\r\n"); // also for an empty body
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if(EVP_DigestFinal_ex(d_ctx.get(), md, &len) != 1)
+      throw std::runtime_error("Could not hash body: "+getOpenSSLError());
+    return base64::to_base64(string_view((const char*)md, len));
+  }
+
+private:
+  void hash(std::string_view data)
+  {
+    if(EVP_DigestUpdate(d_ctx.get(), data.data(), data.size()) != 1)
+      throw std::runtime_error("Could not hash body: "+getOpenSSLError());
+  }
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> d_ctx;
+  std::string d_held;
+};
+}
+
+DKIMSigner::DKIMSigner(const std::string& domain, const std::string& selector, const std::string& pem) : d_domain(domain), d_selector(selector)
+{
+  if(d_domain.empty() || d_selector.empty())
+    throw std::runtime_error("DKIM needs a domain and a selector");
+
+  std::unique_ptr<BIO, decltype(&BIO_free)> bio(BIO_new_mem_buf(pem.data(), pem.size()), BIO_free);
+  if(bio)
+    d_key = PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr);
+  if(!d_key)
+    throw std::runtime_error("Could not read DKIM private key: "+getOpenSSLError());
+  if(EVP_PKEY_get_base_id(d_key) != EVP_PKEY_RSA) {
+    EVP_PKEY_free(d_key);
+    throw std::runtime_error("DKIM private key is not an RSA key");
+  }
+  d_ctx = EVP_MD_CTX_new();
+  if(!d_ctx || EVP_DigestSignInit(d_ctx, nullptr, EVP_sha256(), nullptr, d_key) != 1) {
+    string err = getOpenSSLError();
+    EVP_MD_CTX_free(d_ctx);
+    EVP_PKEY_free(d_key);
+    throw std::runtime_error("Could not set up DKIM signing: "+err);
+  }
+}
+
+DKIMSigner::~DKIMSigner()
+{
+  EVP_MD_CTX_free(d_ctx);
+  EVP_PKEY_free(d_key);
+}
+
+// lowercase name, no whitespace around the colon, runs of whitespace become one space, no line folding
+std::string DKIMSigner::relaxedHeader(std::string_view field)
+{
+  auto colon = field.find(':');
+  string_view name = field.substr(0, colon);
+  name = name.substr(0, name.find_last_not_of(" \t") + 1);
+
+  string ret;
+  ret.reserve(field.size());
+  for(char c : name)
+    ret.append(1, (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c);
+  ret.append(1, ':');
+  if(colon == string_view::npos)
+    return ret + "\r\n";
+
+  size_t start = ret.size();
+  bool space = false;
+  for(char c : field.substr(colon + 1)) {
+    if(c == '\r' || c == '\n')
+      continue;
+    if(c == ' ' || c == '\t') {
+      space = true;
+      continue;
+    }
+    if(space && ret.size() != start)
+      ret.append(1, ' ');
+    space = false;
+    ret.append(1, c);
+  }
+  return ret + "\r\n";
+}
+
+std::string DKIMSigner::getBodyHash(const std::vector<std::string_view>& pieces)
+{
+  BodyHasher bh;
+  for(const auto& p : pieces)
+    bh.update(p);
+  return bh.final();
+}
+
+// the headers we sign, if present. Changing any of these invalidates the signature
+static const char* const s_signed[] = {"from", "to", "subject", "date", "message-id", "mime-version", "content-type", "content-transfer-encoding",
+				       "list-unsubscribe", "list-unsubscribe-post", "list-id", "auto-submitted", "precedence"};
+
+void DKIMSigner::sign(MIMEBuffers& msg, time_t now) const
+{
+  // the header section is in the buffer the MIMEBuffers owns, so copying it is cheap, the body is hashed where it is
+  string head;
+  BodyHasher body;
+  bool inbody = false;
+  for(const auto& iov : msg.getIOVecs()) {
+    string_view piece((const char*)iov.iov_base, iov.iov_len);
+    if(inbody) {
+      body.update(piece);
+      continue;
+    }
+    size_t from = head.size() < 3 ? 0 : head.size() - 3;
+    head.append(piece);
+    auto pos = head.find("\r\n\r\n", from);
+    if(pos != string::npos) {
+      inbody = true;
+      body.update(string_view(head).substr(pos + 4));
+      head.resize(pos + 2);
+    }
+  }
+
+  // lowercase name, and the whole field, which continues on lines that start with whitespace
+  vector<pair<string, string_view>> fields;
+  for(size_t pos = 0; pos < head.size();) {
+    size_t end = pos;
+    do {
+      end = head.find("\r\n", end);
+      end = end == string::npos ? head.size() : end + 2;
+    } while(end < head.size() && (head[end] == ' ' || head[end] == '\t'));
+    string_view field(head.data() + pos, end - pos);
+    string name = relaxedHeader(field);
+    fields.emplace_back(name.substr(0, name.find(':')), field);
+    pos = end;
+  }
+
+  // if a header is there more than once, the last one counts (RFC 6376 5.4.2)
+  string hlist, data;
+  for(const char* name : s_signed) {
+    auto iter = find_if(fields.rbegin(), fields.rend(), [&](const auto& f) { return f.first == name; });
+    if(iter == fields.rend())
+      continue;
+    if(!hlist.empty())
+      hlist.append(1, ':');
+    hlist.append(name);
+    data.append(relaxedHeader(iter->second));
+  }
+
+  string sig = fmt::format("DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/simple; d={}; s={};\r\n\tt={}; h={};\r\n\tbh={};\r\n\tb=",
+			   d_domain, d_selector, now, hlist, body.final());
+  // the signature header itself is signed too, with an empty b=, and without its \r\n
+  data.append(relaxedHeader(sig));
+  data.resize(data.size() - 2);
+
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  size_t len = 0;
+  if(!ctx || EVP_MD_CTX_copy_ex(ctx.get(), d_ctx) != 1 || EVP_DigestSignUpdate(ctx.get(), data.c_str(), data.size()) != 1 ||
+     EVP_DigestSignFinal(ctx.get(), nullptr, &len) != 1)
+    throw std::runtime_error("DKIM signing failed: "+getOpenSSLError());
+  string rsasig(len, '\0');
+  if(EVP_DigestSignFinal(ctx.get(), (unsigned char*)rsasig.data(), &len) != 1)
+    throw std::runtime_error("DKIM signing failed: "+getOpenSSLError());
+  rsasig.resize(len);
+
+  string b = base64::to_base64(rsasig);
+  for(size_t pos = 0; pos < b.size(); pos += 72) {
+    if(pos)
+      sig.append("\r\n\t");
+    sig.append(b, pos, 72);
+  }
+  sig.append("\r\n");
+  msg.prepend(sig);
+}
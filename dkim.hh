@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <ctime>
+#include "mime.hh"
+
+typedef struct evp_pkey_st EVP_PKEY;
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+/* Signs messages with DKIM (RFC 6376), rsa-sha256, with relaxed header and
+   simple body canonicalization, so the smart host does not have to.
+
+   The private key is parsed once, and a signing context is set up for it
+   once, which every message then starts from with a cheap copy. The body is
+   hashed straight from the pieces of the MIMEBuffers, so the attachments that
+   are shared between recipients do not get copied to be hashed. SHA-256 can
+   only pick up where it left off, so anything after the first per-recipient
+   byte has to be hashed for each recipient, but that turns out to be cheap
+   next to the RSA operation, see the 'dkim benchmark' in testrunner.
+
+   Thread safe, sign() can be called from many threads at the same time. */
+class DKIMSigner
+{
+public:
+  //! pem is the private key itself, not a filename
+  DKIMSigner(const std::string& domain, const std::string& selector, const std::string& pem);
+  ~DKIMSigner();
+  DKIMSigner(const DKIMSigner&) = delete;
+
+  //! puts a DKIM-Signature header in front of msg, which holds the headers and body, without the final "."
+  void sign(MIMEBuffers& msg, time_t now) const;
+
+  //! a header field, including its final \r\n, in relaxed canonical form
+  static std::string relaxedHeader(std::string_view field);
+  //! base64 of the SHA-256 of the body in simple canonical form, the body may be split anywhere
+  static std::string getBodyHash(const std::vector<std::string_view>& pieces);
+
+private:
+  std::string d_domain;
+  std::string d_selector;
+  EVP_PKEY* d_key{nullptr};
+  EVP_MD_CTX* d_ctx{nullptr}; // initialized for signing with d_key, copied for every message
+};
@@ -0,0 +1,71 @@
+#include "latency.hh"
+#include <cmath>
+
+using namespace std;
+
+unsigned int LatencyHistogram::getBucket(double usec)
+{
+  if(usec < 2)
+    return 0;
+  return std::min((unsigned int)std::log2(usec), numBuckets - 1);
+}
+
+void LatencyHistogram::addBucket(unsigned int bucket, uint64_t count)
+{
+  d_buckets.at(std::min(bucket, numBuckets - 1)) += count;
+  d_count += count;
+}
+
+double LatencyHistogram::getPercentile(double p) const
+{
+  uint64_t limit = std::ceil(p * d_count), seen = 0;
+  for(unsigned int b = 0; b < numBuckets; ++b) {
+    seen += d_buckets[b];
+    if(seen && seen >= limit)
+      return std::ldexp(1.0, b + 1);
+  }
+  return 0;
+}
+
+void LatencyRecorder::add(const std::string& launchId, const std::string& relay, const std::string& phase, double usec)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  d_hists[{launchId, relay, phase}].add(usec);
+}
+
+void LatencyRecorder::flush(SQLiteWriter& db)
+{
+  decltype(d_hists) hists;
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    hists.swap(d_hists);
+  }
+  if(hists.empty())
+    return;
+
+  db.queryT("begin");
+  try {
+    for(const auto& [key, hist] : hists) {
+      const auto& [launchId, relay, phase] = key;
+      const auto& buckets = hist.getBuckets();
+      for(unsigned int b = 0; b < buckets.size(); ++b) {
+	if(!buckets[b])
+	  continue;
+	db.queryT("insert into latency (launchId, relay, phase, bucket, count) values (?, ?, ?, ?, ?) on conflict(launchId, relay, phase, bucket) do update set count=count+excluded.count",
+		  {launchId, relay, phase, (int64_t)b, (int64_t)buckets[b]});
+      }
+    }
+    db.queryT("commit");
+  }
+  catch(...) {
+    db.queryT("rollback");
+    throw;
+  }
+}
+
+void LatencyRecorder::initTable(SQLiteWriter& db)
+{
+  db.addValue({{"launchId", ""}, {"relay", ""}, {"phase", ""}, {"bucket", -1}, {"count", 0}}, "latency");
+  db.queryT("delete from latency where bucket=-1");
+  db.queryT("create unique index if not exists latencyidx on latency(launchId, relay, phase, bucket)");
+}
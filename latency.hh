@@ -0,0 +1,61 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include "sqlwriter.hh"
+
+/* A histogram with power-of-two buckets: bucket b counts samples from 2^b up
+   to 2^(b+1) microseconds, so 32 buckets cover everything from a microsecond
+   to over an hour. That is precise enough to see where the time goes, and
+   histograms can simply be added up, across workers, runs and runners. */
+class LatencyHistogram
+{
+public:
+  static constexpr unsigned int numBuckets = 32;
+  static unsigned int getBucket(double usec);
+
+  void add(double usec)
+  {
+    addBucket(getBucket(usec), 1);
+  }
+  void addBucket(unsigned int bucket, uint64_t count);
+  uint64_t getCount() const
+  {
+    return d_count;
+  }
+  //! upper bound of the bucket where fraction p (0-1) of samples is, in microseconds
+  double getPercentile(double p) const;
+  const std::array<uint64_t, numBuckets>& getBuckets() const
+  {
+    return d_buckets;
+  }
+  void clear()
+  {
+    d_buckets.fill(0);
+    d_count = 0;
+  }
+
+private:
+  std::array<uint64_t, numBuckets> d_buckets{};
+  uint64_t d_count{0};
+};
+
+/* Collects a LatencyHistogram per launch, smart host and SMTP phase, and adds
+   them to the 'latency' table (launchId, relay, phase, bucket, count) when
+   you call flush(). Thread safe. */
+class LatencyRecorder
+{
+public:
+  void add(const std::string& launchId, const std::string& relay, const std::string& phase, double usec);
+  //! writes what we have, and starts over. Call this outside of a transaction, it makes its own
+  void flush(SQLiteWriter& db);
+  //! creates the latency table and its index, if needed
+  static void initTable(SQLiteWriter& db);
+
+private:
+  std::mutex d_lock;
+  std::map<std::tuple<std::string, std::string, std::string>, LatencyHistogram> d_hists;
+};
@@ -0,0 +1,186 @@
+#include "mime.hh"
+#include "support.hh"
+#include <fmt/chrono.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include "base64.hpp"
+
+using namespace std;
+
+void MIMEBuffers::addOwned(size_t offset, size_t len)
+{
+  if(!len)
+    return;
+  d_size += len;
+  if(!d_pieces.empty() && !d_pieces.back().ptr && d_pieces.back().offset + d_pieces.back().len == offset)
+    d_pieces.back().len += len;
+  else
+    d_pieces.push_back({nullptr, offset, len});
+}
+
+void MIMEBuffers::append(std::string_view str)
+{
+  size_t before = d_own.size();
+  d_own.append(str);
+  addOwned(before, str.size());
+}
+
+void MIMEBuffers::reference(std::string_view str)
+{
+  if(str.empty())
+    return;
+  d_size += str.size();
+  d_pieces.push_back({str.data(), 0, str.size()});
+}
+
+void MIMEBuffers::prepend(std::string_view str)
+{
+  if(str.empty())
+    return;
+  size_t before = d_own.size();
+  d_own.append(str);
+  d_size += str.size();
+  d_pieces.insert(d_pieces.begin(), {nullptr, before, str.size()});
+}
+
+std::vector<iovec> MIMEBuffers::getIOVecs() const
+{
+  vector<iovec> ret;
+  ret.reserve(d_pieces.size());
+  for(const auto& p : d_pieces)
+    ret.push_back({(void*)(p.ptr ? p.ptr : d_own.c_str() + p.offset), p.len});
+  return ret;
+}
+
+void MIMEBuffers::writeTo(int fd, double timeout) const
+{
+  auto iov = getIOVecs();
+  size_t pos = 0;
+  while(pos < iov.size()) {
+    ssize_t res = ::writev(fd, &iov[pos], std::min(iov.size() - pos, (size_t)IOV_MAX));
+    if(res < 0) {
+      if(errno == EINTR)
+	continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+	throw std::runtime_error("Error writing message: "+string(strerror(errno)));
+      pollfd pfd{fd, POLLOUT, 0};
+      int ret = poll(&pfd, 1, timeout * 1000);
+      if(ret < 0 && errno != EINTR)
+	throw std::runtime_error("Error waiting to write message: "+string(strerror(errno)));
+      if(!ret)
+	throw std::runtime_error("Timeout writing message");
+      continue;
+    }
+    // skip what got written, which may end halfway a piece
+    size_t done = res;
+    while(pos < iov.size() && done >= iov[pos].iov_len)
+      done -= iov[pos++].iov_len;
+    if(done) {
+      iov[pos].iov_base = (char*)iov[pos].iov_base + done;
+      iov[pos].iov_len -= done;
+    }
+  }
+}
+
+void MIMEBuffers::clear()
+{
+  d_own.clear();
+  d_pieces.clear();
+  d_size = 0;
+}
+
+MailAttachment::MailAttachment(const std::string& id, const std::string& fname) : d_id(id), d_fname(fname)
+{
+  string type="jpeg";
+  if(endsWith(fname, ".png"))
+    type="png";
+  else if(endsWith(fname, ".webp"))
+    type="webp";
+  d_type = "image/"+type;
+
+  appendBase64Lines(d_b64, getContentsOfFile(fname));
+  if(d_b64.empty())
+    d_b64 = "\r\n";
+}
+
+void buildMIMEMessage(MIMEBuffers& out, const std::string& from, const std::string& to, const std::string& subject, const std::string& textBody, const std::string& htmlBody, const std::vector<MailAttachment>& att,
+		      const std::vector<std::pair<std::string, std::string>>& headers)
+{
+  out.appendf("From: {}\r\nTo: {}\r\n", from, to);
+
+  bool needb64 = false;
+  for(const auto& c : subject) {
+    if(c < 32 || (unsigned char)c > 127) {
+      needb64 = true;
+      break;
+    }
+  }
+  if(needb64)
+    out.appendf("Subject: =?utf-8?B?{}?=\r\n", base64::to_base64(subject));
+  else
+    out.appendf("Subject: {}\r\n", subject);
+
+  for(const auto& h : headers)
+    out.appendf("{}: {}\r\n", h.first, h.second);
+
+  out.appendf("Message-Id: <{}@opentk.hostname>\r\n", getRandom64());
+
+  //Date: Thu, 28 Dec 2023 14:31:37 +0100 (CET)
+  out.appendf("Date: {:%a, %d %b %Y %H:%M:%S %z (%Z)}\r\n", fmt::localtime(time(0)));
+
+  out.append("Auto-Submitted: auto-generated\r\nPrecedence: bulk\r\n");
+
+  string sepa="_----------=_MCPart_"+getLargeId();
+  if(htmlBody.empty()) {
+    out.append("Content-Type: text/plain; charset=\"utf-8\"\r\n");
+    out.append("Content-Transfer-Encoding: quoted-printable\r\n");
+  }
+  else {
+    out.appendf("Content-Type: multipart/alternative; boundary=\"{}\"\r\n", sepa);
+    out.append("MIME-Version: 1.0\r\n");
+  }
+  out.append("\r\n");
+
+  if(!htmlBody.empty()) {
+    out.append("This is a multi-part message in MIME format\r\n\r\n");
+
+    out.appendf("--{}\r\n", sepa);
+    out.append("Content-Type: text/plain; charset=\"utf-8\"; format=\"fixed\"\r\n");
+    out.append("Content-Transfer-Encoding: quoted-printable\r\n\r\n");
+  }
+  appendQuotedPrintable(out.startAppend(), textBody);
+  out.finishAppend();
+  out.append("\r\n");
+
+  if(htmlBody.empty()) {
+    out.append("\r\n");
+    return;
+  }
+  out.appendf("--{}\r\n", sepa);
+
+  string sepa2 = "_"+getLargeId();
+  out.appendf("Content-Type: multipart/related; boundary=\"{}\"\r\n\r\n", sepa2);
+
+  out.appendf("--{}\r\n", sepa2);
+
+  out.append("Content-Type: text/html; charset=\"utf-8\"\r\n");
+  out.append("Content-Transfer-Encoding: base64\r\n\r\n");
+  appendBase64Lines(out.startAppend(), htmlBody);
+  out.finishAppend();
+
+  for(const auto& a : att) {
+    out.appendf("--{}\r\n", sepa2);
+    out.appendf("Content-Type: {}; name=\"{}\"\r\n", a.d_type, a.d_fname);
+    out.appendf("Content-Disposition: inline; filename=\"{}\"\r\n", a.d_fname);
+    out.appendf("Content-Id: <{}>\r\n", a.d_id);
+    out.append("Content-Transfer-Encoding: base64\r\n\r\n");
+    out.reference(a.d_b64);
+  }
+
+  out.appendf("--{}--\r\n\r\n", sepa2);
+  out.appendf("--{}--\r\n", sepa);
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+#include <fmt/format.h>
+
+/* A message that is assembled out of pieces, and written out with writev, so
+   a mail costs a handful of syscalls instead of one per line. Small things,
+   like headers, get copied into a buffer we own, where consecutive pieces end
+   up next to each other. Big things that are shared between recipients, like
+   encoded attachments, are only referenced, and must outlive the MIMEBuffers. */
+class MIMEBuffers
+{
+public:
+  MIMEBuffers()
+  {
+    d_own.reserve(4096);
+    d_pieces.reserve(32);
+  }
+  //! copies str
+  void append(std::string_view str);
+  template<typename... Args>
+  void appendf(fmt::format_string<Args...> fmt, Args&&... args)
+  {
+    size_t before = d_own.size();
+    fmt::format_to(std::back_inserter(d_own), fmt, std::forward<Args>(args)...);
+    addOwned(before, d_own.size() - before);
+  }
+  //! does not copy str, so it needs to stay around until we are written
+  void reference(std::string_view str);
+  //! copies str, and puts it in front of everything else, for headers that depend on the rest of the message
+  void prepend(std::string_view str);
+  //! gives access to our own buffer, for encoders that want to write into it directly
+  std::string& startAppend()
+  {
+    d_mark = d_own.size();
+    return d_own;
+  }
+  void finishAppend()
+  {
+    addOwned(d_mark, d_own.size() - d_mark);
+  }
+
+  size_t size() const
+  {
+    return d_size;
+  }
+  std::vector<iovec> getIOVecs() const;
+  //! writes everything to fd, which may be non-blocking, in which case we wait up to timeout seconds for it to become writable
+  void writeTo(int fd, double timeout) const;
+  void clear();
+
+private:
+  void addOwned(size_t offset, size_t len);
+  struct Piece
+  {
+    const char* ptr; // nullptr if it is in d_own, which may still move
+    size_t offset;   // in d_own
+    size_t len;
+  };
+  std::string d_own;
+  std::vector<Piece> d_pieces;
+  size_t d_size{0};
+  size_t d_mark{0};
+};
+
+/* An inline image, read from disk and base64 encoded (wrapped at 76 columns)
+   once, so it can be sent to many recipients without redoing that work. */
+struct MailAttachment
+{
+  MailAttachment(const std::string& id, const std::string& fname);
+  std::string d_id;    // the cid
+  std::string d_fname;
+  std::string d_type;  // like image/png
+  std::string d_b64;   // includes the final \r\n
+};
+
+//! headers and body of a message, without the final ".", the attachments are referenced, not copied
+void buildMIMEMessage(MIMEBuffers& out, const std::string& from, const std::string& to, const std::string& subject, const std::string& textBody, const std::string& htmlBody, const std::vector<MailAttachment>& att,
+		      const std::vector<std::pair<std::string, std::string>>& headers);
@@ -0,0 +1,575 @@
+#include "queuerunner.hh"
+#include <fmt/printf.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "support.hh"
+#include "smtp.hh"
+#include "smtpengine.hh"
+#include "spool.hh"
+#include "inja.hpp"
+
+using namespace std;
+
+/* inja environments are not thread safe while parsing, so every message gets
+   its own, and they are only used for rendering once they are in d_msgs. The
+   text and html versions need separate environments because of the escaping. */
+struct QueueRunner::CompiledMessage
+{
+  CompiledMessage(const std::string& textversion, const std::string& htmlversion)
+  {
+    textenv.set_html_autoescape(false); // NOTE WELL!
+    htmlenv.set_html_autoescape(true); // NOTE WELL!
+    text = textenv.parse(textversion);
+    html = htmlenv.parse(htmlversion);
+  }
+  inja::Environment textenv, htmlenv;
+  inja::Template text, html;
+  std::vector<MailAttachment> att; // read & encoded once, shared by all recipients
+};
+
+QueueRunner::QueueRunner(SQLiteWriter& db, const QueueRunnerSettings& qrs) : d_db(db), d_qrs(qrs)
+{
+  char hostname[256]="";
+  gethostname(hostname, sizeof(hostname)-1);
+  d_owner = fmt::format("{}/{}/{}", hostname, getpid(), getLargeId());
+
+  if(!d_qrs.numWorkers)
+    d_qrs.numWorkers = 1;
+  if(!d_qrs.fetchBatch)
+    d_qrs.fetchBatch = 1;
+  if(!d_qrs.spoolDir.empty() || d_qrs.dryRun) // no network, so threads it is
+    d_qrs.sessions = 0;
+  if(d_qrs.dryRun) { // no waiting for new rows, or for anything else but the CPU
+    d_qrs.daemon = false;
+    d_qrs.sessions = 0;
+    d_qrs.reservedWorkers = 0;
+  }
+  d_qrs.reservedWorkers = std::min(d_qrs.reservedWorkers, (d_qrs.sessions ? d_qrs.sessions : d_qrs.numWorkers) - 1);
+}
+
+static double getNow()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// CPU time used by this thread, so time spent waiting for locks or the disk does not count
+static uint64_t getThreadCPUUsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Claims the next batch of unsent rows that are due, by giving them a lease
+   with our name on it. This happens in a single statement, so if several
+   runners share the database, each row gets claimed by only one of them. Rows
+   with an expired lease, for example from a runner that crashed, are up for
+   grabs again. We only fetch the per-recipient columns, the message bodies are
+   loaded once per msgId by getMessage(). With 'urgent', only rows from the
+   lanes above Bulk are claimed.
+
+   The IN on priority makes SQLite seek to the rows that are due in each lane
+   of queueprioidx, so rows scheduled for later cost nothing, no matter how
+   many there are.
+
+   A dry run claims nothing, so runners that do send can keep going. It just
+   reads every row that is due, in rowid order, and all lanes at once.
+   Called with d_lock held. */
+void QueueRunner::fetchMore(bool urgent)
+{
+  time_t now = time(0);
+  vector<row_t> rows;
+  if(d_qrs.dryRun) {
+    if(urgent)
+      return;
+    d_status->exclusive([&]() {
+      rows = d_db.queryT("select rowid, id queueId, msgId, launchId, channelId, channelName, timsi, userId, destination, subject, attempts, nextAttempt, priority from queue where sent=0 and failed=0 and priority in (0, 1, 2) and nextAttempt <= ? and rowid > ? order by rowid limit ?",
+			 {(int64_t)now, d_lastrowid, (int64_t)d_qrs.fetchBatch});
+    });
+    if(!rows.empty())
+      d_lastrowid = get<int64_t>(rows.back().at("rowid"));
+  }
+  else {
+    d_status->exclusive([&]() {
+      rows = d_db.queryT(fmt::format("update queue set leaseOwner=?, leaseExpiry=? where rowid in (select rowid from queue where sent=0 and failed=0 and priority in ({}) and nextAttempt <= ? and leaseExpiry < ? order by priority, nextAttempt, rowid limit ?) returning rowid, id queueId, msgId, launchId, channelId, channelName, timsi, userId, destination, subject, attempts, nextAttempt, priority",
+				     urgent ? "0, 1" : "0, 1, 2"),
+			 {d_owner, (int64_t)(now + d_qrs.leaseTime), (int64_t)now, (int64_t)now, (int64_t)d_qrs.fetchBatch});
+    });
+  }
+  if(!urgent && rows.size() < d_qrs.fetchBatch)
+    d_exhausted = true;
+
+  // RETURNING does not respect the order of the subquery
+  sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+    return tie(get<int64_t>(a.at("nextAttempt")), get<int64_t>(a.at("rowid"))) <
+      tie(get<int64_t>(b.at("nextAttempt")), get<int64_t>(b.at("rowid")));
+  });
+  for(auto& r : rows) {
+    d_lanes.at(iget(r, "priority"))[getDomain(eget(r, "destination"))].push_back(std::move(r));
+    ++d_buffered;
+  }
+}
+
+/* Our rows stay ours as long as we keep extending the lease. Rows that
+   failed were released by the StatusWriter, and sent rows are no longer
+   interesting to anyone, so this only touches rows we are still working on.
+   Called with d_lock held. */
+void QueueRunner::renewLeases()
+{
+  time_t now = time(0);
+  if(d_qrs.dryRun || now - d_lastrenew < d_qrs.leaseTime / 4)
+    return;
+  d_lastrenew = now;
+  d_status->exclusive([&]() {
+    d_db.queryT("update queue set leaseExpiry=? where leaseOwner=? and sent=0 and failed=0",
+		{(int64_t)(now + d_qrs.leaseTime), d_owner});
+  });
+}
+
+/* data_version changes whenever another connection commits to the database,
+   so it is a cheap way to find out if there might be new rows in the queue.
+   Called with d_lock held. */
+bool QueueRunner::checkForChanges()
+{
+  auto res = d_db.queryT("pragma data_version");
+  int64_t version = iget(res.at(0), "data_version");
+  bool changed = version != d_dataversion;
+  d_dataversion = version;
+  return changed;
+}
+
+/* Hands out every row exactly once, to whichever worker asks first. The
+   higher lanes go first, and reserved workers only get rows from those.
+   Returns 1 with a row, or 0 if there is nothing for now, with 'wait' set to
+   how long to wait before asking again, or -1 if there will be no more. */
+int QueueRunner::pollNext(row_t& row, bool reserved, double& wait)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  for(;;) {
+    if(d_stop)
+      return -1;
+    renewLeases();
+    if(time(0) - d_lastlatency >= 60) {
+      d_lastlatency = time(0);
+      d_status->exclusive([&]() { d_latency.flush(d_db); });
+    }
+    // a login link should not wait until we are done with the bulk rows we already have
+    if(getNow() - d_lastcheck >= 0.25) {
+      d_lastcheck = getNow();
+      // our own retries coming due do not change data_version, so look every few seconds anyway
+      if(checkForChanges() || ++d_idlecount % 20 == 0) {
+	if(d_qrs.daemon)
+	  d_exhausted = false;
+	fetchMore(true);
+      }
+    }
+    if(!d_exhausted && d_buffered < d_qrs.fetchBatch / 2)
+      fetchMore(false);
+
+    for(int lane = Transactional; lane < Bulk; ++lane) {
+      auto& rows = d_lanes[lane];
+      if(rows.empty())
+	continue;
+      auto iter = rows.begin();
+      row = std::move(iter->second.front());
+      iter->second.pop_front();
+      --d_buffered;
+      if(iter->second.empty())
+	rows.erase(iter);
+      return 1;
+    }
+
+    auto& rows = d_lanes[Bulk];
+    wait = 0.25;
+    if(!reserved && !rows.empty()) {
+      // round robin, starting at the domain after the one we did last
+      auto iter = rows.upper_bound(d_lastdomain);
+      for(size_t n = 0; n < rows.size(); ++n, ++iter) {
+	if(iter == rows.end())
+	  iter = rows.begin();
+	double w = d_limiter.tryTake(iter->first, getNow());
+	if(w == 0) {
+	  row = std::move(iter->second.front());
+	  iter->second.pop_front();
+	  --d_buffered;
+	  d_lastdomain = iter->first;
+	  if(iter->second.empty())
+	    rows.erase(iter);
+	  return 1;
+	}
+	wait = std::min(wait, w);
+      }
+      // every domain we have rows for is out of tokens, perhaps further down the queue there are other domains
+      if(!d_exhausted && d_buffered < 4 * d_qrs.fetchBatch) {
+	fetchMore(false);
+	continue;
+      }
+    }
+    else if(!d_buffered && d_exhausted && !d_qrs.daemon)
+      return -1;
+    return 0;
+  }
+}
+
+bool QueueRunner::getNext(row_t& row, bool reserved)
+{
+  for(;;) {
+    double wait;
+    int ret = pollNext(row, reserved, wait);
+    if(ret)
+      return ret > 0;
+    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+  }
+}
+
+std::shared_ptr<QueueRunner::CompiledMessage> QueueRunner::getMessage(const row_t& q)
+{
+  std::lock_guard<std::mutex> l(d_msglock);
+  auto& cm = d_msgs[eget(q, "msgId")];
+  if(!cm) {
+    auto msg = d_db.queryT("select textversion, htmlversion from msgs where id=?", {eget(q, "msgId")});
+    if(msg.empty())
+      throw std::runtime_error("No such message "+eget(q, "msgId"));
+    auto ncm = std::make_shared<CompiledMessage>(eget(msg[0], "textversion"), eget(msg[0], "htmlversion"));
+    for(auto& r : d_db.query("select * from attachments where msgId=?", {eget(q, "msgId")}))
+      ncm->att.emplace_back(r["id"], r["filename"]);
+    cm = ncm;
+  }
+  return cm;
+}
+
+QueueRunner::RenderedRow QueueRunner::renderRow(const row_t& q)
+{
+  RenderedRow ret;
+  auto& cm = ret.cm = getMessage(q);
+  nlohmann::json data;
+  data["weblink"] = "https://berthub.eu/ckmailer/msg/"+eget(q, "msgId");
+  data["unsubscribelink"] = "https://berthub.eu/ckmailer/manage.html?timsi="+eget(q, "timsi");
+  data["channelName"] = eget(q, "channelName");
+  data["channelLink"] = "https://berthub.eu/ckmailer/channel.html?channelId="+eget(q, "channelId");
+
+  ret.text = cm->textenv.render(cm->text, data);
+  ret.html = cm->htmlenv.render(cm->html, data);
+
+  ret.headers = {
+    {"List-Unsubscribe", "<https://berthub.eu/ckmailer/unsubscribe/"+eget(q, "userId")+"/"+eget(q, "channelId")+">, <mailto:bmailer+"+eget(q, "queueId")+"@hubertnet.nl?subject="+eget(q, "userId")+"/"+eget(q, "channelId")+">"},
+    {"List-Unsubscribe-Post", "List-Unsubscribe=One-Click"},
+    {"List-ID", eget(q, "channelName") + " <"+eget(q, "channelId")+">"}
+  };
+  return ret;
+}
+
+// the whole message, signed if we sign, the CompiledMessage holds the attachments msg refers to
+std::shared_ptr<QueueRunner::CompiledMessage> QueueRunner::buildRow(const row_t& q, MIMEBuffers& msg)
+{
+  auto r = renderRow(q);
+  buildMIMEMessage(msg, d_qrs.senderEmail, eget(q, "destination"), eget(q, "subject"), r.text, r.html, r.cm->att, r.headers);
+  if(d_dkim)
+    d_dkim->sign(msg, time(0));
+  return r.cm;
+}
+
+void QueueRunner::sendRow(SMTPSession& session, const row_t& q)
+{
+  auto r = renderRow(q);
+  session.sendEmail(d_qrs.senderEmail, // channel setting really
+		    eget(q, "destination"),
+		    eget(q, "subject"), // subject
+		    r.text,
+		    r.html,
+		    "",
+		    "bmailer+"+ eget(q, "queueId") +"@hubertnet.nl", r.cm->att, r.headers);
+}
+
+void QueueRunner::reportFailure(const row_t& q, const std::string& error, bool permanent)
+{
+  int64_t attempts = iget(q, "attempts") + 1;
+  if(attempts >= d_qrs.maxAttempts)
+    permanent = true;
+
+  time_t delay = d_qrs.retryBase;
+  for(int n = 1; n < attempts && delay < d_qrs.retryMax; ++n)
+    delay *= 2;
+  delay = std::min(delay, (time_t)d_qrs.retryMax);
+
+  if(permanent)
+    fmt::print("Failed to send message to {}, giving up after {} attempt(s): {}\n", eget(q, "destination"), attempts, error);
+  else
+    fmt::print("Failed to send message to {}, attempt {}, will retry in {} seconds: {}\n", eget(q, "destination"), attempts, delay, error);
+  d_status->markFailed(eget(q, "queueId"), attempts, time(0) + delay, permanent, error);
+}
+
+void QueueRunner::worker(unsigned int num)
+try
+{
+  SMTPSession session(d_relays); // connects on first use, and then stays connected
+  session.setDKIM(d_dkim);
+  bool reserved = num < d_qrs.reservedWorkers;
+  row_t q;
+  while(getNext(q, reserved)) {
+    if(d_qrs.verbose)
+      fmt::print("Worker {} sending to {}\n", num, eget(q, "destination"));
+    try {
+      sendRow(session, q);
+      d_status->markSent(eget(q, "queueId"));
+      addLatency(q, session.getRelay(), session.getTimings());
+    }
+    catch(SMTPError& e) { // a reply about this message, so a 5xx means it will never work
+      reportFailure(q, e.what(), e.d_code >= 500);
+    }
+    catch(std::exception& e) {
+      reportFailure(q, e.what(), false);
+    }
+  }
+}
+catch(std::exception& e)
+{
+  fmt::print("Worker {} giving up: {}\n", num, e.what());
+}
+
+/* Instead of sending, writes messages into a pickup directory for a local
+   MTA. Rows are only marked as sent once their batch has been committed, and
+   we commit whenever there is nothing to do right away, so in daemon mode a
+   message does not wait for its batch to fill up. */
+void QueueRunner::spoolWorker(unsigned int num)
+try
+{
+  MaildirSpool spool(d_qrs.spoolDir);
+  bool reserved = num < d_qrs.reservedWorkers;
+  vector<row_t> batch;
+  auto commit = [&]() {
+    size_t delivered = batch.size();
+    try {
+      spool.commit();
+    }
+    catch(SpoolError& e) {
+      delivered = e.d_delivered;
+      for(size_t n = delivered; n < batch.size(); ++n)
+	reportFailure(batch[n], e.what(), false);
+    }
+    for(size_t n = 0; n < delivered; ++n)
+      d_status->markSent(eget(batch[n], "queueId"));
+    batch.clear();
+  };
+
+  MIMEBuffers msg;
+  row_t q;
+  for(;;) {
+    double wait;
+    int ret = pollNext(q, reserved, wait);
+    if(ret <= 0) {
+      commit();
+      if(ret < 0)
+	break;
+      std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+      continue;
+    }
+    if(d_qrs.verbose)
+      fmt::print("Worker {} spooling for {}\n", num, eget(q, "destination"));
+    try {
+      msg.clear();
+      buildRow(q, msg);
+      spool.add(eget(q, "queueId"), "bmailer+"+ eget(q, "queueId") +"@hubertnet.nl", eget(q, "destination"), msg);
+      batch.push_back(std::move(q));
+    }
+    catch(std::exception& e) {
+      reportFailure(q, e.what(), false);
+    }
+    if(batch.size() >= d_qrs.spoolBatch)
+      commit();
+  }
+}
+catch(std::exception& e)
+{
+  fmt::print("Worker {} giving up: {}\n", num, e.what());
+}
+
+/* Does everything sendRow() and SMTPSession do to a row, except talking to
+   the relay: the message goes to /dev/null instead. Nothing gets claimed,
+   or marked as sent or failed, so the rows are still there for the real run. */
+void QueueRunner::dryRunWorker(unsigned int num)
+try
+{
+  int fd = open("/dev/null", O_WRONLY);
+  if(fd < 0)
+    throw std::runtime_error("Could not open /dev/null: "+string(strerror(errno)));
+  auto t = getThreadCPUUsec();
+  auto lap = [&](DryRunStage stage) {
+    auto now = getThreadCPUUsec();
+    d_dryrun.usec[stage] += now - t;
+    t = now;
+  };
+
+  MIMEBuffers msg;
+  row_t q;
+  while(getNext(q, false)) {
+    try {
+      lap(DryRunQueue);
+      getMessage(q); // only expensive the first time, when the attachments get read and encoded
+      lap(DryRunLoad);
+      auto r = renderRow(q);
+      lap(DryRunRender);
+      msg.clear();
+      buildMIMEMessage(msg, d_qrs.senderEmail, eget(q, "destination"), eget(q, "subject"), r.text, r.html, r.cm->att, r.headers);
+      lap(DryRunMIME);
+      if(d_dkim) {
+	d_dkim->sign(msg, time(0));
+	lap(DryRunDKIM);
+      }
+      msg.append(".\r\n");
+      msg.writeTo(fd, 5);
+      lap(DryRunWrite);
+      d_dryrun.bytes += msg.size();
+      d_dryrun.messages++;
+    }
+    catch(std::exception& e) {
+      fmt::print("Worker {} could not build message for {}: {}\n", num, eget(q, "destination"), e.what());
+      d_dryrun.failed++;
+    }
+  }
+  lap(DryRunQueue);
+  close(fd);
+}
+catch(std::exception& e)
+{
+  fmt::print("Worker {} giving up: {}\n", num, e.what());
+}
+
+void QueueRunner::printDryRun(double seconds) const
+{
+  static const char* names[] = {"load", "render", "mime", "dkim", "write", "queue"};
+  uint64_t total = 0;
+  for(const auto& u : d_dryrun.usec)
+    total += u;
+  uint64_t msgs = std::max<uint64_t>(1, d_dryrun.messages);
+  fmt::print("Dry run: built {} messages ({} failed), {:.1f} MB, in {:.2f} s using {:.2f} s of CPU, {:.1f} messages per CPU second\n",
+	     d_dryrun.messages, d_dryrun.failed, d_dryrun.bytes / 1000000.0, seconds, total / 1000000.0, d_dryrun.messages * 1000000.0 / std::max<uint64_t>(1, total));
+  fmt::print("  {:<7} {:>10} {:>12} {:>6}\n", "stage", "cpu ms", "usec/msg", "share");
+  for(unsigned int n = 0; n < d_dryrun.usec.size(); ++n)
+    fmt::print("  {:<7} {:>10.1f} {:>12.1f} {:>5.1f}%\n", names[n], d_dryrun.usec[n] / 1000.0, (double)d_dryrun.usec[n] / msgs,
+	       total ? 100.0 * d_dryrun.usec[n] / total : 0.0);
+  fmt::print("  {:.0f} bytes per message\n", (double)d_dryrun.bytes / msgs);
+}
+
+void QueueRunner::addLatency(const row_t& q, const std::string& relay, const SMTPTimings& t)
+{
+  for(unsigned int n = 0; n < t.usec.size(); ++n)
+    if(t.usec[n] >= 0)
+      d_latency.add(eget(q, "launchId"), relay, SMTPTimings::names[n], t.usec[n]);
+}
+
+/* Like the workers, but all sessions are driven by an SMTPEngine in this one
+   thread, which also does the rendering. */
+void QueueRunner::runEngine()
+{
+  SMTPEngine engine(d_relays, d_qrs.sessions);
+  struct InFlight
+  {
+    row_t row;
+    std::shared_ptr<CompiledMessage> cm; // the attachments are not copied into the message, so they have to stay around
+  };
+  std::unordered_map<uint64_t, InFlight> inflight;
+  uint64_t id = 0;
+
+  auto getJob = [&](SMTPJob& job, unsigned int session, double& wait) {
+    row_t q;
+    for(;;) {
+      int ret = pollNext(q, session < d_qrs.reservedWorkers, wait);
+      if(ret <= 0) {
+	if(ret < 0)
+	  wait = -1;
+	return false;
+      }
+      if(d_qrs.verbose)
+	fmt::print("Session {} sending to {}\n", session, eget(q, "destination"));
+      try {
+	auto cm = buildRow(q, job.msg);
+	job.envelopeFrom = "bmailer+"+ eget(q, "queueId") +"@hubertnet.nl";
+	job.to = eget(q, "destination");
+	job.id = ++id;
+	inflight[job.id] = {std::move(q), cm};
+	return true;
+      }
+      catch(std::exception& e) {
+	reportFailure(q, e.what(), false);
+      }
+    }
+  };
+
+  auto done = [&](SMTPJob& job, int code, const std::string& error) {
+    auto iter = inflight.find(job.id);
+    if(iter == inflight.end())
+      return;
+    const auto& q = iter->second.row;
+    if(error.empty()) {
+      d_status->markSent(eget(q, "queueId"));
+      addLatency(q, job.relay, job.timings);
+    }
+    else
+      reportFailure(q, error, code >= 500);
+    inflight.erase(iter);
+  };
+
+  engine.run(getJob, done);
+}
+
+void QueueRunner::run()
+{
+  // a dry run measures how fast we can build messages, so it does not wait for rate limits
+  if(!d_qrs.dryRun) {
+    for(auto& r : d_db.queryT("select name, value from settings where name like 'ratelimit-%'")) {
+      string domain = eget(r, "name").substr(10);
+      d_limiter.setLimit(domain, eget(r, "value"));
+      fmt::print("Rate limiting {} to {}\n", domain, eget(r, "value"));
+    }
+  }
+
+  auto count = d_db.queryT("select count(1) filter (where nextAttempt <= ?) c, count(1) filter (where attempts=0 and nextAttempt > ?) later from queue where sent=0 and failed=0",
+			  {(int64_t)time(0), (int64_t)time(0)});
+  fmt::print("{} {} queued messages using {} {}, of which {} reserved for transactional mail and tests{}\n",
+	     d_qrs.dryRun ? "Dry run, building" : "Sending", iget(count[0], "c"),
+	     d_qrs.sessions ? d_qrs.sessions : d_qrs.numWorkers, d_qrs.sessions ? "sessions" : "workers", d_qrs.reservedWorkers, d_qrs.daemon ? ", and then waiting for more" : "");
+  if(iget(count[0], "later"))
+    fmt::print("{} messages are scheduled for later{}\n", iget(count[0], "later"), d_qrs.daemon ? ", they will be sent when they are due" : ", use --daemon to send them when they are due");
+  checkForChanges();
+
+  if(!d_qrs.spoolDir.empty() && !d_qrs.dryRun)
+    fmt::print("Writing messages to spool directory {}\n", d_qrs.spoolDir);
+  else {
+    d_relays = std::make_shared<RelayPool>(d_qrs.smtpServer);
+    for(size_t n = 0; n < d_relays->size(); ++n)
+      fmt::print("Relay {}\n", d_relays->describe(n, time(0)));
+  }
+
+  if(!d_qrs.dkimKey.empty()) {
+    d_dkim = std::make_shared<DKIMSigner>(d_qrs.dkimDomain, d_qrs.dkimSelector, getContentsOfFile(d_qrs.dkimKey));
+    fmt::print("Signing with DKIM for {}, selector {}\n", d_qrs.dkimDomain, d_qrs.dkimSelector);
+  }
+
+  d_status = std::make_unique<StatusWriter>(d_db, d_owner, d_qrs.statusBatch, d_qrs.statusMsec);
+  d_lastrenew = d_lastlatency = time(0);
+  double start = getNow();
+  if(d_qrs.sessions)
+    runEngine();
+  else {
+    vector<thread> workers;
+    for(unsigned int n = 0; n < d_qrs.numWorkers; ++n)
+      workers.emplace_back(d_qrs.dryRun ? &QueueRunner::dryRunWorker : !d_qrs.spoolDir.empty() ? &QueueRunner::spoolWorker : &QueueRunner::worker, this, n);
+    for(auto& w : workers)
+      w.join();
+  }
+  if(d_qrs.dryRun)
+    printDryRun(getNow() - start);
+  d_status.reset(); // commits what is left
+  d_latency.flush(d_db);
+  for(size_t n = 0; d_relays && n < d_relays->size(); ++n)
+    fmt::print("Relay {}\n", d_relays->describe(n, time(0)));
+
+  // anything we claimed but did not get to, perhaps because we were stopped, goes back to the pool
+  d_db.queryT("update queue set leaseOwner='', leaseExpiry=0 where leaseOwner=? and sent=0", {d_owner});
+}
@@ -0,0 +1,191 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "sqlwriter.hh"
+#include "ratelimit.hh"
+#include "statuswriter.hh"
+#include "relaypool.hh"
+#include "latency.hh"
+
+class SMTPSession;
+class MIMEBuffers;
+struct SMTPTimings;
+class DKIMSigner;
+
+/* The queue runner sends out everything in the 'queue' table that has not
+   been sent yet. It starts a number of worker threads, each of which keeps
+   its own SMTPSession with a smart host open for the whole run. The sessions
+   are spread over the relays in smtpServer, see RelayPool. Rows are
+   handed out by the runner, so each row is claimed by precisely one worker.
+
+   Several runners, in different processes or on different hosts, can share one
+   queue. A runner claims a batch of rows by putting its name and a lease expiry
+   time on them, and renews that lease while it works on them. Once a lease
+   expires, because a runner died, the rows return to the pool.
+
+   Rows are kept per destination domain, and the runner goes round robin over
+   the domains. Domains can be rate limited through settings named like
+   'ratelimit-gmail.com', with a value like "2/10" (2 messages/second, bursts
+   of 10). A domain that is out of tokens is skipped, so it does not hold up
+   mail to other domains. 'ratelimit-default' applies to all other domains.
+
+   The queue is claimed in batches of rows that only contain the per-recipient
+   columns, so memory use does not depend on how many rows are queued. Each
+   message is loaded and parsed into inja templates only once per run, after
+   which every recipient only needs a render with their own links.
+
+   A row that fails with a temporary error is tried again later, with
+   exponential backoff: after retryBase seconds, then twice that, up to
+   retryMax. Only rows whose 'nextAttempt' has passed are selected. A 5xx
+   reply, or running out of attempts, marks the row as 'failed' for good.
+
+   A scheduled launch gives each of its rows a 'nextAttempt' somewhere in its
+   sending window, which is recorded with the launch. A runner in daemon mode
+   looks for rows that came due every few seconds, so they go out at an even
+   pace.
+
+   If there is a DKIM key, we sign all mail with it, see DKIMSigner. The key
+   is loaded once, and shared by all workers.
+
+   How long each SMTP phase takes is collected per launch and smart host, and
+   written to the 'latency' table every minute, and at the end of the run.
+
+   Rows have a priority, which puts them in a lane: 0 for transactional mail
+   like login links, 1 for test sends, 2 for bulk. Rows are claimed in order
+   of priority, and the runner looks for new rows in the higher lanes a few
+   times per second, even while it still has a batch of bulk rows to work
+   through. Those rows are handed out first, and do not wait for rate
+   limits. In addition, reservedWorkers of the workers never send bulk, so a
+   login link does not have to wait until a worker is done with a slow bulk
+   session. There is always at least one worker left for bulk. Note that
+   nothing queues transactional rows yet: ckmserv still sends account links
+   itself, with its own SMTPSession.
+
+   Instead of a thread per session, the runner can also drive many sessions
+   from a single thread, see SMTPEngine. This is what 'sessions' is for: with
+   slow smart hosts, it keeps a few hundred messages in flight without
+   hundreds of threads. The sessions then take the role of the workers,
+   also for reservedWorkers. Rendering and signing happen in that same
+   thread, which is fine as long as they are fast next to the round trips.
+
+   With a spoolDir, the workers do not talk SMTP at all, but hand the
+   messages to a local MTA through its pickup directory, see MaildirSpool.
+   Each worker commits its messages in batches of spoolBatch, and only then
+   marks them as sent.
+
+   A dry run does all the work of building the messages, including DKIM, but
+   writes them to /dev/null, and then prints how much CPU time went to each
+   stage. It does not wait for rate limits, and it does not change the queue.
+   This is for finding out how much CPU a launch needs, without the relays
+   getting in the way.
+
+   In daemon mode, the runner does not exit once the queue is empty, but keeps
+   its sessions and caches, and checks SQLite's 'PRAGMA data_version' a few
+   times per second to notice that another process queued new rows.
+*/
+
+struct QueueRunnerSettings
+{
+  std::string smtpServer;        // a RelayPool spec, like "10.0.0.2, 10.0.0.3:587*2"
+  std::string senderEmail;
+  std::string dkimKey;           // filename of the private key, we do not sign if this is empty
+  std::string dkimDomain;
+  std::string dkimSelector;
+  unsigned int numWorkers{1};
+  unsigned int statusBatch{100}; // see StatusWriter for what these mean for crash safety
+  unsigned int statusMsec{1000};
+  unsigned int fetchBatch{1000}; // rows read from the queue at a time
+  unsigned int retryBase{60};    // seconds
+  unsigned int retryMax{4*3600};
+  unsigned int maxAttempts{10};
+  unsigned int leaseTime{300};   // seconds we own the rows we claimed, renewed while we work on them
+  unsigned int reservedWorkers{1}; // workers that only send transactional mail and tests
+  unsigned int sessions{0};      // if set, use an SMTPEngine with this many sessions instead of numWorkers threads
+  bool daemon{false};
+  std::string spoolDir;          // if set, messages go into this pickup directory instead of to smtpServer, see MaildirSpool
+  unsigned int spoolBatch{100};  // messages per fsync of the spool
+  bool dryRun{false};            // build every message, but send it to /dev/null, and report where the CPU time went
+  bool verbose{true};            // a line per message sent
+};
+
+class QueueRunner
+{
+public:
+  //! the 'priority' column of the queue, lower goes first. Rows with other values are not sent
+  enum Priority : int { Transactional = 0, Test = 1, Bulk = 2, NumLanes = 3 };
+
+  QueueRunner(SQLiteWriter& db, const QueueRunnerSettings& qrs);
+  void run();
+  //! makes run() return after the workers finish what they are doing, safe to call from a signal handler
+  void stop()
+  {
+    d_stop = true;
+  }
+
+private:
+  typedef std::unordered_map<std::string, MiniSQLite::outvar_t> row_t;
+  struct CompiledMessage;
+  std::shared_ptr<CompiledMessage> getMessage(const row_t& q);
+  void fetchMore(bool urgent);
+  void renewLeases();
+  bool checkForChanges();
+  int pollNext(row_t& row, bool reserved, double& wait);
+  bool getNext(row_t& row, bool reserved);
+  void worker(unsigned int num);
+  void runEngine();
+  void spoolWorker(unsigned int num);
+  void dryRunWorker(unsigned int num);
+  void printDryRun(double seconds) const;
+  struct RenderedRow
+  {
+    std::shared_ptr<CompiledMessage> cm;
+    std::string text, html;
+    std::vector<std::pair<std::string, std::string>> headers;
+  };
+  RenderedRow renderRow(const row_t& q);
+  std::shared_ptr<CompiledMessage> buildRow(const row_t& q, MIMEBuffers& msg);
+  void sendRow(SMTPSession& session, const row_t& q);
+  void addLatency(const row_t& q, const std::string& relay, const SMTPTimings& t);
+  void reportFailure(const row_t& q, const std::string& error, bool permanent);
+
+  SQLiteWriter& d_db;
+  QueueRunnerSettings d_qrs;
+  std::unique_ptr<StatusWriter> d_status;
+  std::shared_ptr<RelayPool> d_relays; // shared by the sessions of all workers
+  std::shared_ptr<const DKIMSigner> d_dkim; // same, if we sign
+  LatencyRecorder d_latency;
+  std::atomic<bool> d_stop{false};
+
+  // for a dry run: CPU time per stage, summed over the workers
+  enum DryRunStage { DryRunLoad, DryRunRender, DryRunMIME, DryRunDKIM, DryRunWrite, DryRunQueue, DryRunNumStages };
+  struct
+  {
+    std::array<std::atomic<uint64_t>, DryRunNumStages> usec{};
+    std::atomic<uint64_t> bytes{0}, messages{0}, failed{0};
+  } d_dryrun;
+
+  std::mutex d_lock; // protects d_lanes, d_lastdomain, d_limiter and the leases
+  std::array<std::map<std::string, std::deque<row_t>>, NumLanes> d_lanes; // per priority, per domain
+  size_t d_buffered{0}; // total number of rows in d_lanes
+  std::string d_owner; // our name on the leases
+  time_t d_lastrenew{0};
+  time_t d_lastlatency{0};
+  double d_lastcheck{0}; // last look for new rows
+  bool d_exhausted{false};
+  int64_t d_dataversion{-1};
+  int64_t d_lastrowid{0}; // how far a dry run got, as it does not claim rows
+  unsigned int d_idlecount{0};
+  std::string d_lastdomain;
+  DomainRateLimiter d_limiter;
+
+  std::mutex d_msglock; // protects d_msgs
+  std::map<std::string, std::shared_ptr<CompiledMessage>> d_msgs; // per msgId
+};
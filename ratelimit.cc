@@ -0,0 +1,57 @@
+#include "ratelimit.hh"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+double TokenBucket::tryTake(double now)
+{
+  if(d_last >= 0)
+    d_tokens = std::min(d_burst, d_tokens + (now - d_last) * d_rate);
+  d_last = now;
+
+  if(d_tokens >= 1) {
+    d_tokens -= 1;
+    return 0;
+  }
+  return (1 - d_tokens) / d_rate;
+}
+
+void DomainRateLimiter::setLimit(const std::string& domain, double rate, double burst)
+{
+  if(rate <= 0)
+    throw std::runtime_error("Rate limit for domain '"+domain+"' must be positive");
+  d_limits[getDomain("@"+domain)] = {rate, std::max(burst, 1.0)};
+  d_buckets.clear();
+}
+
+void DomainRateLimiter::setLimit(const std::string& domain, const std::string& spec)
+{
+  auto pos = spec.find('/');
+  double rate = atof(spec.c_str());
+  double burst = pos == string::npos ? rate : atof(spec.c_str() + pos + 1);
+  setLimit(domain, rate, burst);
+}
+
+double DomainRateLimiter::tryTake(const std::string& domain, double now)
+{
+  auto iter = d_buckets.find(domain);
+  if(iter == d_buckets.end()) {
+    auto liter = d_limits.find(domain);
+    if(liter == d_limits.end())
+      liter = d_limits.find("default");
+    if(liter == d_limits.end())
+      return 0; // not limited
+    iter = d_buckets.emplace(domain, TokenBucket(liter->second.first, liter->second.second)).first;
+  }
+  return iter->second.tryTake(now);
+}
+
+std::string getDomain(const std::string& email)
+{
+  auto pos = email.rfind('@');
+  string ret = pos == string::npos ? email : email.substr(pos + 1);
+  for(auto& c : ret)
+    c = tolower(c);
+  return ret;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <map>
+#include <string>
+
+/* Classic token bucket. It starts out full with 'burst' tokens, and refills at
+   'rate' tokens per second, up to 'burst'. Sending a message costs a token.
+   Times are in seconds, from whatever clock you like, as long as it does not go
+   backwards. */
+class TokenBucket
+{
+public:
+  TokenBucket(double rate, double burst) : d_rate(rate), d_burst(burst), d_tokens(burst)
+  {}
+
+  //! returns 0 if we got a token, otherwise the number of seconds until there will be one
+  double tryTake(double now);
+
+private:
+  double d_rate;
+  double d_burst;
+  double d_tokens;
+  double d_last{-1};
+};
+
+/* Keeps a TokenBucket per destination domain. Domains without a configured limit
+   are not limited at all, unless a 'default' limit was set, in which case each
+   such domain gets its own bucket with that limit. Not thread safe. */
+class DomainRateLimiter
+{
+public:
+  void setLimit(const std::string& domain, double rate, double burst);
+  //! parses "rate/burst", like "2/10" for 2 messages/second with bursts of 10
+  void setLimit(const std::string& domain, const std::string& spec);
+  double tryTake(const std::string& domain, double now);
+
+private:
+  std::map<std::string, std::pair<double,double>> d_limits;
+  std::map<std::string, TokenBucket> d_buckets;
+};
+
+//! lowercase domain part of an email address
+std::string getDomain(const std::string& email);
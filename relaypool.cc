@@ -0,0 +1,91 @@
+#include "relaypool.hh"
+#include <fmt/format.h>
+#include <algorithm>
+#include <stdexcept>
+#include "support.hh"
+
+using namespace std;
+
+RelayPool::RelayPool(const std::string& spec, unsigned int maxFails, unsigned int ejectTime) : d_maxFails(std::max(maxFails, 1U)), d_ejectTime(ejectTime)
+{
+  for(auto part : splitString(spec, ",")) {
+    part.erase(0, part.find_first_not_of(" \t"));
+    part.erase(part.find_last_not_of(" \t") + 1);
+    if(part.empty())
+      continue;
+    Relay r;
+    auto pos = part.find('*');
+    if(pos != string::npos) {
+      int weight = atoi(part.c_str() + pos + 1);
+      if(weight <= 0)
+	throw std::runtime_error("Invalid weight for SMTP relay '"+part+"'");
+      r.weight = weight;
+      part.resize(pos);
+    }
+    r.addr = ComboAddress(part, 25);
+    d_relays.push_back(r);
+  }
+  if(d_relays.empty())
+    throw std::runtime_error("No SMTP server configured");
+}
+
+size_t RelayPool::acquire(time_t now, const std::vector<size_t>& avoid)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  size_t best = d_relays.size();
+  for(size_t n = 0; n < d_relays.size(); ++n) {
+    const auto& r = d_relays[n];
+    if(isEjected(r, now) || find(avoid.begin(), avoid.end(), n) != avoid.end())
+      continue;
+    // fewest sessions relative to weight: a/wa < b/wb
+    if(best == d_relays.size() || (r.sessions + 1) * d_relays[best].weight < (d_relays[best].sessions + 1) * r.weight)
+      best = n;
+  }
+  if(best == d_relays.size()) { // all of them are ejected, or to be avoided
+    best = 0;
+    for(size_t n = 1; n < d_relays.size(); ++n)
+      if(d_relays[n].ejectedUntil < d_relays[best].ejectedUntil)
+	best = n;
+  }
+
+  auto& r = d_relays[best];
+  if(r.fails >= d_maxFails) // this session is the probe, the rest wait for its verdict
+    r.ejectedUntil = now + d_ejectTime;
+  r.sessions++;
+  return best;
+}
+
+void RelayPool::release(size_t n)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto& r = d_relays.at(n);
+  if(r.sessions)
+    r.sessions--;
+}
+
+void RelayPool::reportSuccess(size_t n)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto& r = d_relays.at(n);
+  r.fails = 0;
+  r.ejections = 0;
+  r.ejectedUntil = 0;
+}
+
+void RelayPool::reportFailure(size_t n, time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  auto& r = d_relays.at(n);
+  if(++r.fails < d_maxFails)
+    return;
+  r.ejectedUntil = now + ((time_t)d_ejectTime << std::min(r.ejections, 5U));
+  r.ejections++;
+}
+
+std::string RelayPool::describe(size_t n, time_t now)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  const auto& r = d_relays.at(n);
+  return fmt::format("{} (weight {}, {} sessions{})", r.addr.toStringWithPort(), r.weight, r.sessions,
+		     isEjected(r, now) ? fmt::format(", ejected for {}s", r.ejectedUntil - now) : "");
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <mutex>
+#include <string>
+#include <vector>
+#include "swrappers.hh"
+
+/* The smart hosts we can hand our mail to, configured like
+   "10.0.0.2, 10.0.0.3:587*2", where the optional '*2' is a weight: that relay
+   gets twice as many sessions as a relay with weight 1. Without a port, 25 is
+   used.
+
+   Sessions acquire a relay when they connect, and release it when they
+   disconnect. A new session goes to the relay with the fewest sessions
+   relative to its weight. After 'maxFails' consecutive failures (connections
+   that could not be made or got lost), a relay is ejected for 'ejectTime'
+   seconds, doubling each time it gets ejected again, up to 32 times that.
+   Once that time has passed, a single session is allowed to probe it, and if
+   that works out, the relay is back in business.
+
+   If all relays are ejected, we use the one that is due to return first,
+   rather than not sending at all. Thread safe. */
+class RelayPool
+{
+public:
+  explicit RelayPool(const std::string& spec, unsigned int maxFails=3, unsigned int ejectTime=30);
+  RelayPool(const RelayPool&) = delete;
+
+  //! picks a relay for a new session, which counts against it until release(), preferably not one from 'avoid'
+  size_t acquire(time_t now, const std::vector<size_t>& avoid={});
+  void release(size_t n);
+  //! a message got accepted, so the relay is healthy
+  void reportSuccess(size_t n);
+  void reportFailure(size_t n, time_t now);
+
+  ComboAddress getAddress(size_t n) const
+  {
+    return d_relays.at(n).addr; // never changes after construction
+  }
+  size_t size() const
+  {
+    return d_relays.size();
+  }
+  //! like "10.0.0.2:25 (weight 1, 2 sessions, ejected)"
+  std::string describe(size_t n, time_t now);
+
+private:
+  struct Relay
+  {
+    ComboAddress addr;
+    unsigned int weight{1};
+    unsigned int sessions{0};
+    unsigned int fails{0};       // consecutive
+    unsigned int ejections{0};   // consecutive
+    time_t ejectedUntil{0};
+  };
+  bool isEjected(const Relay& r, time_t now) const
+  {
+    return r.fails >= d_maxFails && r.ejectedUntil > now;
+  }
+
+  std::mutex d_lock; // protects the mutable parts of d_relays
+  std::vector<Relay> d_relays;
+  unsigned int d_maxFails;
+  unsigned int d_ejectTime;
+};
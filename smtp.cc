@@ -0,0 +1,326 @@
+#include "smtp.hh"
+#include "support.hh"
+
+using namespace std;
+
+namespace {
+  // the server hung up on us, or told us it is about to (421)
+  struct SMTPConnectionLost : public std::runtime_error
+  {
+    SMTPConnectionLost(const std::string& what, bool eof) : std::runtime_error(what), d_eof(eof)
+    {}
+    bool d_eof;
+  };
+}
+
+SMTPSession::SMTPSession(const std::string& server) : d_pool(std::make_shared<RelayPool>(server))
+{
+}
+
+SMTPSession::SMTPSession(std::shared_ptr<RelayPool> pool) : d_pool(pool)
+{
+}
+
+SMTPSession::~SMTPSession()
+{
+  disconnect();
+}
+
+// tries each relay the pool hands us, until one works
+void SMTPSession::connect()
+{
+  vector<size_t> tried;
+  for(;;) {
+    d_relay = d_pool->acquire(time(0), tried);
+    tried.push_back(d_relay);
+    d_haverelay = true;
+    try {
+      d_lap = std::chrono::steady_clock::now();
+      auto server = d_pool->getAddress(d_relay);
+      d_sock = std::make_unique<Socket>(server.sin4.sin_family, SOCK_STREAM);
+      d_sc = std::make_unique<SocketCommunicator>(*d_sock);
+      d_sc->connect(server);
+      d_needrset = false;
+      d_capabilities.clear();
+      sponge(220);
+      lap(SMTPTimings::Connect);
+      write("EHLO outer2.berthub.eu\r\n");
+      string reply;
+      vector<string> lines;
+      int code = getReply(reply, &lines);
+      if(code != 250)
+	throw SMTPError("Unexpected response to EHLO: '"+reply+"'", code);
+      lap(SMTPTimings::Ehlo);
+
+      // the first line is the greeting, the rest are capabilities, like '250-PIPELINING'
+      for(size_t n = 1; n < lines.size(); ++n) {
+	string cap = lines[n].substr(4);
+	auto pos = cap.find_first_of(" \r\n");
+	if(pos != string::npos)
+	  cap.resize(pos);
+	for(auto& c : cap)
+	  c = toupper(c);
+	d_capabilities.insert(cap);
+      }
+      d_connected = time(0);
+      d_connsent = 0;
+      return;
+    }
+    catch(std::exception& e) {
+      drop(true);
+      // a relay that will not talk to us says nothing about the message, so this is not an SMTPError, even for a 5xx
+      if(tried.size() >= d_pool->size())
+	throw std::runtime_error(e.what());
+    }
+  }
+}
+
+// forgets the connection without saying goodbye, and releases our relay
+void SMTPSession::drop(bool failed)
+{
+  if(d_haverelay) {
+    if(failed)
+      d_pool->reportFailure(d_relay, time(0));
+    d_pool->release(d_relay);
+    d_haverelay = false;
+  }
+  d_sc.reset();
+  d_sock.reset();
+}
+
+// the time since the previous lap goes to 'phase'
+void SMTPSession::lap(SMTPTimings::Phase phase)
+{
+  auto now = std::chrono::steady_clock::now();
+  d_timings.usec[phase] = std::chrono::duration<double, std::micro>(now - d_lap).count();
+  d_lap = now;
+}
+
+// polite if we can, but never throws
+void SMTPSession::disconnect()
+{
+  if(d_sc) {
+    try {
+      write("QUIT\r\n");
+      sponge(221);
+    }
+    catch(...) {}
+  }
+  drop(false);
+}
+
+void SMTPSession::write(const std::string& str)
+{
+  try {
+    d_sc->writen(str);
+  }
+  catch(std::exception& e) {
+    throw SMTPConnectionLost("Error writing to SMTP server: "+string(e.what()), true);
+  }
+}
+
+// returns the SMTP code, and the full (possibly multi-line) reply in 'reply'
+int SMTPSession::getReply(std::string& reply, std::vector<std::string>* lines)
+{
+  string line;
+  reply.clear();
+  if(lines)
+    lines->clear();
+  for(;;) {
+    if(!d_sc->getLine(line))
+      throw SMTPConnectionLost("SMTP server closed the connection", true);
+    if(line.size() < 4)
+      throw std::runtime_error("Invalid response from SMTP server: '"+line+"'");
+    reply += line;
+    if(lines)
+      lines->push_back(line);
+    if(line.at(3) == ' ')
+      break;
+  }
+  return atoi(reply.c_str());
+}
+
+// like getReply, but a 421 means we lost the connection
+int SMTPSession::getCode(std::string& reply)
+{
+  int code = getReply(reply);
+  if(code == 421)
+    throw SMTPConnectionLost("SMTP server is closing the connection: '"+reply+"'", false);
+  return code;
+}
+
+void SMTPSession::sponge(int expected)
+{
+  string reply;
+  int code = getCode(reply);
+  if(code != expected)
+    throw SMTPError("Unexpected response from SMTP server: '"+reply+"'", code);
+}
+
+// MAIL, RCPT and DATA one by one, waiting for each reply
+void SMTPSession::sendEnvelope(const std::string& envelopeFrom, const std::vector<std::string>& rcpts)
+{
+  write("MAIL From:<"+envelopeFrom+">\r\n");
+  sponge(250);
+  lap(SMTPTimings::Mail);
+
+  for(const auto& r : rcpts) {
+    write("RCPT To:<"+ r +">\r\n");
+    sponge(250);
+  }
+  lap(SMTPTimings::Rcpt);
+
+  write("DATA\r\n");
+  sponge(354);
+  lap(SMTPTimings::Data);
+}
+
+/* RFC 2920: we send MAIL, all RCPTs and DATA in one write, and then read the
+   replies in the same order. With a single recipient that gets rejected, the
+   server must refuse DATA because there are no valid recipients. With more
+   recipients, we only send DATA once we know they were all accepted, so we never
+   end up sending a message to only part of the recipients. */
+void SMTPSession::pipelineEnvelope(const std::string& envelopeFrom, const std::vector<std::string>& rcpts)
+{
+  bool withData = rcpts.size() == 1;
+  string cmds = "MAIL From:<"+envelopeFrom+">\r\n";
+  for(const auto& r : rcpts)
+    cmds += "RCPT To:<"+ r +">\r\n";
+  if(withData)
+    cmds += "DATA\r\n";
+  write(cmds);
+
+  // we must read all replies, even after an error, to stay in sync
+  string reply, err;
+  int errcode = 0;
+  int code = getCode(reply);
+  if(code != 250) {
+    err = "MAIL From:<"+envelopeFrom+"> rejected by SMTP server: '"+reply+"'";
+    errcode = code;
+  }
+  lap(SMTPTimings::Mail);
+  for(const auto& r : rcpts) {
+    code = getCode(reply);
+    if(code != 250 && err.empty()) {
+      err = "RCPT To:<"+r+"> rejected by SMTP server: '"+reply+"'";
+      errcode = code;
+    }
+  }
+  lap(SMTPTimings::Rcpt);
+  if(withData) {
+    code = getCode(reply);
+    if(code == 354 && !err.empty()) {
+      // should not happen, but if it does, send an empty message to no one
+      write(".\r\n");
+      getCode(reply);
+    }
+    else if(code != 354 && err.empty()) {
+      err = "DATA rejected by SMTP server: '"+reply+"'";
+      errcode = code;
+    }
+  }
+  if(!err.empty())
+    throw SMTPError(err, errcode);
+
+  if(!withData) {
+    write("DATA\r\n");
+    sponge(354);
+  }
+  lap(SMTPTimings::Data);
+}
+
+void SMTPSession::sendEmail(const std::string& from, const std::string& to, const std::string& subject, const std::string& textBody, const std::string& htmlBody, const std::string& bcc, const std::string& envelopeFrom, const std::vector<MailAttachment>& att,
+			    const std::vector<std::pair<std::string, std::string>>& headers)
+{
+  string rEnvelopeFrom = envelopeFrom.empty() ? from : envelopeFrom;
+
+  const char* allowed="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-.@=";
+  if(from.find_first_not_of(allowed) != string::npos || to.find_first_not_of(allowed) != string::npos) {
+    throw SMTPError("Illegal character in from or to address", 553); // no server will take it either, so do not retry
+  }
+
+  // now and then we go back to the pool, so a relay that was ejected gets its share of the sessions again once it is back
+  if(d_sc && (d_connsent >= d_recycleMessages || time(0) - d_connected >= d_recycleSeconds))
+    disconnect();
+
+  d_timings.usec.fill(-1);
+  for(bool retried = false; ; ) {
+    bool inRset = false, inData = false, dataSent = false;
+    try {
+      if(!d_sc)
+	connect();
+      else if(d_needrset) {
+	inRset = true;
+	write("RSET\r\n");
+	string reply;
+	if(getCode(reply) != 250)
+	  throw std::runtime_error("Unexpected response to RSET: '"+reply+"'");
+	inRset = false;
+      }
+      d_needrset = true;
+      d_lap = std::chrono::steady_clock::now();
+
+      vector<string> rcpts{to};
+      if(!bcc.empty())
+	rcpts.push_back(bcc);
+
+      if(d_capabilities.count("PIPELINING"))
+	pipelineEnvelope(rEnvelopeFrom, rcpts);
+      else
+	sendEnvelope(rEnvelopeFrom, rcpts);
+      inData = true;
+      writeMessage(from, to, subject, textBody, htmlBody, att, headers);
+      dataSent = true;
+      lap(SMTPTimings::Body);
+      sponge(250);
+      lap(SMTPTimings::Ack);
+      d_numsent++;
+      d_connsent++;
+      d_pool->reportSuccess(d_relay);
+      return;
+    }
+    catch(SMTPConnectionLost& e) {
+      // servers hang up on connections that were idle for a while, which is not a failure, and not a retry either
+      drop(!inRset);
+      if(inRset)
+	continue;
+      // if the server hung up after we sent the whole message, it may have been delivered
+      if(retried || (dataSent && e.d_eof))
+	throw;
+      retried = true;
+    }
+    catch(std::exception& e) {
+      // halfway through DATA there is no way to recover the conversation
+      if(inData && !dataSent)
+	drop(false);
+      throw;
+    }
+  }
+}
+
+// writes the headers and body, including the final ".", in as few writes as possible
+void SMTPSession::writeMessage(const std::string& from, const std::string& to, const std::string& subject, const std::string& textBody, const std::string& htmlBody, const std::vector<MailAttachment>& att,
+			       const std::vector<std::pair<std::string, std::string>>& headers)
+{
+  d_msg.clear();
+  buildMIMEMessage(d_msg, from, to, subject, textBody, htmlBody, att, headers);
+  if(d_dkim)
+    d_dkim->sign(d_msg, time(0));
+  d_msg.append(".\r\n");
+  try {
+    d_msg.writeTo(*d_sock, 5);
+  }
+  catch(std::exception& e) {
+    throw SMTPConnectionLost(e.what(), true);
+  }
+}
+
+void sendEmail(const std::string& server, const std::string& from, const std::string& to, const std::string& subject, const std::string& textBody, const std::string& htmlBody, const std::string& bcc, const std::string& envelopeFrom, const std::vector<std::pair<std::string, std::string>>& att,
+	       const std::vector<std::pair<std::string, std::string>>& headers)
+{
+  vector<MailAttachment> eatt;
+  for(const auto& [id, fname] : att)
+    eatt.emplace_back(id, fname);
+  SMTPSession session(server);
+  session.sendEmail(from, to, subject, textBody, htmlBody, bcc, envelopeFrom, eatt, headers);
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "swrappers.hh"
+#include "sclasses.hh"
+#include "relaypool.hh"
+#include "mime.hh"
+#include "dkim.hh"
+
+/* An SMTPSession is a single connection to a smart host, over which you can
+   send many messages. The connection is made when the first message goes out,
+   and between messages we send RSET. If the server hangs up on us, or says 421
+   (service not available, closing channel), we reconnect and try the message
+   once more, as long as the server did not yet accept it.
+
+   The smart host comes from a RelayPool, which can be shared between sessions.
+   If a relay can not be reached, we try the next one the pool gives us, and
+   reconnects may also end up at another relay. After a number of messages,
+   or of seconds, we disconnect and get a relay from the pool again, so
+   sessions spread out over the relays again after one of them was ejected.
+   A server hanging up on a connection we were not using does not count as
+   a failure of that relay.
+
+   With setDKIM(), every message gets signed before it goes out.
+
+   If the server announces PIPELINING (RFC 2920), MAIL, RCPT and DATA are sent
+   in one go, and the replies are then matched up to the commands in order.
+
+   On destruction, we say QUIT.
+
+   A session is not thread safe, use one per thread.
+*/
+
+//! the server did not like MAIL, RCPT, DATA or the message itself, d_code has the SMTP code. Problems with the connection are other exceptions
+struct SMTPError : public std::runtime_error
+{
+  SMTPError(const std::string& what, int code) : std::runtime_error(what), d_code(code)
+  {}
+  int d_code;
+};
+
+/* How long each step of sending the last message took, in microseconds, or -1
+   if it did not happen for that message (we only connect now and then). With
+   PIPELINING, 'mail' includes the round trip, and 'rcpt' and 'data' are only
+   the time until their replies had also arrived. */
+struct SMTPTimings
+{
+  enum Phase { Connect, Ehlo, Mail, Rcpt, Data, Body, Ack, NumPhases };
+  static constexpr const char* names[NumPhases] = {"connect", "ehlo", "mail", "rcpt", "data", "body", "ack"};
+  std::array<double, NumPhases> usec;
+};
+
+class SMTPSession
+{
+public:
+  //! server is a RelayPool spec, like "10.0.0.2" or "10.0.0.2:587, 10.0.0.3*2"
+  explicit SMTPSession(const std::string& server);
+  explicit SMTPSession(std::shared_ptr<RelayPool> pool);
+  ~SMTPSession();
+  SMTPSession(const SMTPSession&) = delete;
+
+  void sendEmail(const std::string& from, const std::string& to, const std::string& subject, const std::string& textBody, const std::string& htmlBody, const std::string& bcc="", const std::string& envelopeFrom="", const std::vector<MailAttachment>& att={},
+		 const std::vector<std::pair<std::string, std::string>>& headers={});
+
+  //! sign every message from now on, the signer can be shared between sessions
+  void setDKIM(std::shared_ptr<const DKIMSigner> dkim)
+  {
+    d_dkim = dkim;
+  }
+  //! disconnect after this many messages or seconds on a connection, before sending the next message
+  void setRecycle(unsigned int messages, unsigned int seconds)
+  {
+    d_recycleMessages = messages;
+    d_recycleSeconds = seconds;
+  }
+  //! number of messages sent over this session, including across reconnects
+  unsigned int getNumSent() const
+  {
+    return d_numsent;
+  }
+  const SMTPTimings& getTimings() const
+  {
+    return d_timings;
+  }
+  //! the smart host we are (or were last) connected to
+  std::string getRelay() const
+  {
+    return d_pool->getAddress(d_relay).toStringWithPort();
+  }
+
+private:
+  void connect();
+  void disconnect();
+  void drop(bool failed);
+  void lap(SMTPTimings::Phase phase);
+  void write(const std::string& str);
+  int getReply(std::string& reply, std::vector<std::string>* lines=nullptr);
+  int getCode(std::string& reply);
+  void sponge(int expected);
+  void sendEnvelope(const std::string& envelopeFrom, const std::vector<std::string>& rcpts);
+  void pipelineEnvelope(const std::string& envelopeFrom, const std::vector<std::string>& rcpts);
+  void writeMessage(const std::string& from, const std::string& to, const std::string& subject, const std::string& textBody, const std::string& htmlBody, const std::vector<MailAttachment>& att,
+		    const std::vector<std::pair<std::string, std::string>>& headers);
+
+  std::shared_ptr<RelayPool> d_pool;
+  size_t d_relay{0};
+  bool d_haverelay{false}; // if we hold d_relay from d_pool
+  std::unique_ptr<Socket> d_sock;
+  std::unique_ptr<SocketCommunicator> d_sc;
+  std::set<std::string> d_capabilities; // from EHLO, like PIPELINING or 8BITMIME
+  MIMEBuffers d_msg; // reused for every message
+  std::shared_ptr<const DKIMSigner> d_dkim;
+  SMTPTimings d_timings;
+  std::chrono::steady_clock::time_point d_lap;
+  bool d_needrset{false};
+  unsigned int d_numsent{0};
+  unsigned int d_connsent{0}; // on this connection
+  time_t d_connected{0};
+  unsigned int d_recycleMessages{500};
+  unsigned int d_recycleSeconds{300};
+};
@@ -0,0 +1,592 @@
+#include "smtpengine.hh"
+#include <fmt/format.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+  enum class State { Closed, Connecting, Greeting, Ehlo, Ready, Rset, Envelope, AbortData, Body, Ack, Quit };
+
+  double getNow()
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+}
+
+struct SMTPEngine::Session
+{
+  unsigned int num;
+  State state{State::Closed};
+  int fd{-1};
+  uint64_t generation{0};   // goes up for every connection, so we can tell if the one we were working on is gone
+  size_t relay{0};
+  bool haverelay{false};    // if we hold 'relay' from the pool
+  std::vector<size_t> tried; // relays we could not connect to for this message
+  bool pipelining{false};
+  bool needrset{false};
+  bool wantwrite{false};    // if we asked epoll for EPOLLOUT
+
+  double nextask{0};        // when to ask for a job again, after there was none for us
+  double connected{0};      // when the connection was ready
+  unsigned int connsent{0}; // messages sent over this connection
+
+  bool hasjob{false};
+  SMTPJob job;
+  unsigned int tries{0};    // of this message over an established connection
+  unsigned int sent{0}, got{0}; // MAIL, RCPT and DATA commands sent, and replies to them
+  int errcode{0};
+  std::string err;          // the first thing that went wrong with the envelope
+
+  std::string in;           // what we read, but did not yet process
+  std::string out;          // commands we could not yet write
+  size_t outpos{0};
+  std::vector<iovec> iov;   // the message, while we write it
+  size_t iovpos{0};
+  double deadline{0};       // when we give up waiting for the server, 0 if we are not waiting
+  double lapstart{0};
+};
+
+SMTPEngine::SMTPEngine(std::shared_ptr<RelayPool> pool, unsigned int numSessions, double timeout) : d_pool(pool), d_timeout(timeout)
+{
+  d_epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(d_epfd < 0)
+    throw std::runtime_error("Could not create epoll instance: "+string(strerror(errno)));
+  for(unsigned int n = 0; n < std::max(numSessions, 1U); ++n) {
+    d_sessions.push_back(std::make_unique<Session>());
+    d_sessions.back()->num = n;
+  }
+}
+
+SMTPEngine::~SMTPEngine()
+{
+  for(auto& s : d_sessions)
+    close(*s, false);
+  ::close(d_epfd);
+}
+
+void SMTPEngine::lap(Session& s, SMTPTimings::Phase phase)
+{
+  double now = getNow();
+  s.job.timings.usec[phase] = (now - s.lapstart) * 1000000;
+  s.lapstart = now;
+}
+
+void SMTPEngine::startJob(Session& s)
+{
+  s.job.timings.usec.fill(-1);
+  s.job.relay.clear();
+  s.err.clear();
+  s.errcode = 0;
+  if(s.fd < 0)
+    connect(s);
+  else if(s.needrset) {
+    s.state = State::Rset;
+    send(s, "RSET\r\n");
+  }
+  else
+    startEnvelope(s);
+}
+
+// to the next relay the pool has for us, the rest happens once the socket becomes writable
+void SMTPEngine::connect(Session& s)
+{
+  s.relay = d_pool->acquire(time(0), s.tried);
+  s.tried.push_back(s.relay);
+  s.haverelay = true;
+  s.generation++;
+  s.in.clear();
+  s.out.clear();
+  s.outpos = 0;
+  s.pipelining = false;
+  s.needrset = false;
+  s.lapstart = getNow();
+  s.deadline = s.lapstart + d_timeout;
+
+  auto addr = d_pool->getAddress(s.relay);
+  s.fd = socket(addr.sin4.sin_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(s.fd < 0) {
+    lost(s, "Could not create socket: "+string(strerror(errno)), false);
+    return;
+  }
+  s.state = State::Connecting;
+  epoll_event ev{};
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.u32 = s.num;
+  s.wantwrite = true;
+  if(epoll_ctl(d_epfd, EPOLL_CTL_ADD, s.fd, &ev) < 0) {
+    lost(s, "Could not add socket to epoll: "+string(strerror(errno)), false);
+    return;
+  }
+  if(::connect(s.fd, (const sockaddr*)&addr, addr.getSocklen()) < 0 && errno != EINPROGRESS)
+    lost(s, "Could not connect to "+addr.toStringWithPort()+": "+string(strerror(errno)), false);
+}
+
+// forgets the connection without saying goodbye, and releases our relay
+void SMTPEngine::close(Session& s, bool failed)
+{
+  if(s.fd >= 0) {
+    epoll_ctl(d_epfd, EPOLL_CTL_DEL, s.fd, nullptr);
+    ::close(s.fd);
+    s.fd = -1;
+  }
+  if(s.haverelay) {
+    if(failed)
+      d_pool->reportFailure(s.relay, time(0));
+    d_pool->release(s.relay);
+    s.haverelay = false;
+  }
+  s.state = State::Closed;
+  s.deadline = 0;
+}
+
+/* The connection is gone, or never got there. Perhaps another one can do the
+   message. Servers hang up on connections that were idle for a while, like
+   Postfix does with a 421, which we find out about when idle, or when we
+   send RSET. That says nothing about the relay, and does not use up the
+   retry of the message. */
+void SMTPEngine::lost(Session& s, const std::string& why, bool eof)
+{
+  State was = s.state;
+  bool idle = !s.hasjob || was == State::Rset;
+  close(s, !idle);
+  if(!s.hasjob)
+    return;
+  if(idle)
+    connect(s);
+  else if(was == State::Connecting || was == State::Greeting || was == State::Ehlo || was == State::Closed) {
+    if(s.tried.size() < d_pool->size()) {
+      connect(s);
+      return;
+    }
+  }
+  // if the server hung up after we sent the whole message, it may have been delivered
+  else if(!s.tries && !(was == State::Ack && eof)) {
+    s.tries++;
+    s.tried.clear();
+    connect(s);
+    return;
+  }
+  finish(s, 0, why);
+}
+
+void SMTPEngine::finish(Session& s, int code, const std::string& error)
+{
+  s.job.relay = d_pool->getAddress(s.relay).toStringWithPort();
+  s.hasjob = false;
+  s.tries = 0;
+  s.tried.clear();
+  s.nextask = 0; // a session that is done gets asked for its next job right away
+  if(s.state == State::Ready)
+    s.deadline = 0;
+  if(error.empty())
+    d_numsent++;
+  (*d_done)(s.job, code, error);
+
+  // now and then we go back to the pool, so a relay that was ejected gets its share of the sessions again once it is back
+  if(s.state == State::Ready && (s.connsent >= d_recycleMessages || getNow() - s.connected >= d_recycleSeconds)) {
+    s.state = State::Quit;
+    send(s, "QUIT\r\n");
+    if(s.fd >= 0)
+      s.deadline = getNow() + 1;
+  }
+}
+
+void SMTPEngine::send(Session& s, const std::string& str)
+{
+  s.out.append(str);
+  flush(s);
+}
+
+void SMTPEngine::watch(Session& s, bool write)
+{
+  if(s.fd < 0 || s.wantwrite == write)
+    return;
+  epoll_event ev{};
+  ev.events = EPOLLIN | (write ? EPOLLOUT : 0);
+  ev.data.u32 = s.num;
+  epoll_ctl(d_epfd, EPOLL_CTL_MOD, s.fd, &ev);
+  s.wantwrite = write;
+}
+
+/* A server can take its time to accept a message, for example while it
+   scans it, and if we give up before it says yes, the recipient gets the
+   message twice. So like SMTPSession, we wait much longer for that. */
+double SMTPEngine::timeout(const Session& s) const
+{
+  return s.state == State::Ack ? d_ackTimeout : d_timeout;
+}
+
+// writes what we can without blocking: commands first, then the message if we are at that point
+void SMTPEngine::flush(Session& s)
+{
+  s.deadline = getNow() + timeout(s);
+  while(s.outpos < s.out.size()) {
+    ssize_t res = ::send(s.fd, s.out.c_str() + s.outpos, s.out.size() - s.outpos, MSG_NOSIGNAL);
+    if(res < 0) {
+      if(errno == EINTR)
+	continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+	watch(s, true);
+	return;
+      }
+      lost(s, "Error writing to SMTP server: "+string(strerror(errno)), true);
+      return;
+    }
+    s.outpos += res;
+  }
+  s.out.clear();
+  s.outpos = 0;
+
+  while(s.state == State::Body && s.iovpos < s.iov.size()) {
+    ssize_t res = ::writev(s.fd, &s.iov[s.iovpos], std::min(s.iov.size() - s.iovpos, (size_t)IOV_MAX));
+    if(res < 0) {
+      if(errno == EINTR)
+	continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+	watch(s, true);
+	return;
+      }
+      lost(s, "Error writing message: "+string(strerror(errno)), true);
+      return;
+    }
+    // skip what got written, which may end halfway a piece
+    size_t done = res;
+    while(s.iovpos < s.iov.size() && done >= s.iov[s.iovpos].iov_len)
+      done -= s.iov[s.iovpos++].iov_len;
+    if(done) {
+      s.iov[s.iovpos].iov_base = (char*)s.iov[s.iovpos].iov_base + done;
+      s.iov[s.iovpos].iov_len -= done;
+    }
+  }
+  if(s.state == State::Body) {
+    lap(s, SMTPTimings::Body);
+    s.state = State::Ack;
+    s.deadline = getNow() + timeout(s);
+  }
+  watch(s, false);
+}
+
+void SMTPEngine::startEnvelope(Session& s)
+{
+  s.needrset = true;
+  s.lapstart = getNow();
+  s.state = State::Envelope;
+  s.got = 0;
+  string cmds = "MAIL From:<"+s.job.envelopeFrom+">\r\n";
+  if(s.pipelining) { // RFC 2920, the replies come back in the same order
+    cmds += "RCPT To:<"+s.job.to+">\r\nDATA\r\n";
+    s.sent = 3;
+  }
+  else
+    s.sent = 1;
+  send(s, cmds);
+}
+
+/* With PIPELINING, we must read all three replies, even after an error, to
+   stay in sync. A rejected recipient makes the server refuse DATA, because
+   there are no valid recipients. */
+void SMTPEngine::envelopeReply(Session& s, int code, const std::string& reply)
+{
+  static const char* const cmds[] = {"MAIL From", "RCPT To", "DATA"};
+  static const SMTPTimings::Phase phases[] = {SMTPTimings::Mail, SMTPTimings::Rcpt, SMTPTimings::Data};
+  unsigned int step = s.got++;
+  lap(s, phases[step]);
+  if(step == 2 && code == 354 && !s.err.empty()) {
+    // should not happen, but if it does, send an empty message to no one
+    s.state = State::AbortData;
+    send(s, ".\r\n");
+    return;
+  }
+  if(code != (step == 2 ? 354 : 250) && s.err.empty()) {
+    s.errcode = code;
+    s.err = fmt::format("{}{} rejected by SMTP server: '{}'", cmds[step], step == 0 ? ":<"+s.job.envelopeFrom+">" : step == 1 ? ":<"+s.job.to+">" : "", reply);
+  }
+  if(s.got < s.sent)
+    return;
+  if(!s.err.empty()) {
+    s.state = State::Ready;
+    finish(s, s.errcode, s.err);
+    return;
+  }
+  if(s.got == 1) {
+    s.sent++;
+    send(s, "RCPT To:<"+s.job.to+">\r\n");
+  }
+  else if(s.got == 2) {
+    s.sent++;
+    send(s, "DATA\r\n");
+  }
+  else {
+    static const char dot[] = ".\r\n";
+    s.iov = s.job.msg.getIOVecs();
+    s.iov.push_back({(void*)dot, 3});
+    s.iovpos = 0;
+    s.state = State::Body;
+    flush(s);
+  }
+}
+
+void SMTPEngine::handleReply(Session& s, int code, const std::string& reply, const std::vector<std::string>& lines)
+{
+  if(code == 421 && s.state != State::Quit) {
+    lost(s, "SMTP server is closing the connection: '"+reply+"'", false);
+    return;
+  }
+  switch(s.state) {
+  case State::Greeting:
+    if(code != 220) {
+      lost(s, "Unexpected greeting from SMTP server: '"+reply+"'", false);
+      return;
+    }
+    lap(s, SMTPTimings::Connect);
+    s.state = State::Ehlo;
+    send(s, "EHLO outer2.berthub.eu\r\n");
+    break;
+  case State::Ehlo:
+    if(code != 250) {
+      lost(s, "Unexpected response to EHLO: '"+reply+"'", false);
+      return;
+    }
+    lap(s, SMTPTimings::Ehlo);
+    // the first line is the greeting, the rest are capabilities, like '250-PIPELINING'
+    for(size_t n = 1; n < lines.size(); ++n) {
+      string cap = lines[n].substr(4, lines[n].find_first_of(" \r\n", 4) - 4);
+      for(auto& c : cap)
+	c = toupper(c);
+      if(cap == "PIPELINING")
+	s.pipelining = true;
+    }
+    s.state = State::Ready;
+    s.deadline = 0;
+    s.connected = getNow();
+    s.connsent = 0;
+    if(s.hasjob)
+      startEnvelope(s);
+    break;
+  case State::Rset:
+    if(code != 250) {
+      lost(s, "Unexpected response to RSET: '"+reply+"'", false);
+      return;
+    }
+    startEnvelope(s);
+    break;
+  case State::Envelope:
+    envelopeReply(s, code, reply);
+    break;
+  case State::AbortData:
+    s.state = State::Ready;
+    finish(s, s.errcode, s.err);
+    break;
+  case State::Ack:
+    lap(s, SMTPTimings::Ack);
+    s.state = State::Ready;
+    if(code == 250) {
+      s.connsent++;
+      d_pool->reportSuccess(s.relay);
+      finish(s, code, "");
+    }
+    else
+      finish(s, code, "Unexpected response from SMTP server: '"+reply+"'");
+    break;
+  case State::Quit:
+    close(s, false);
+    break;
+  default:
+    lost(s, "Unexpected reply from SMTP server: '"+reply+"'", false);
+  }
+}
+
+// reads what is there, and handles every complete reply in it
+void SMTPEngine::readReplies(Session& s)
+{
+  uint64_t generation = s.generation;
+  bool eof = false;
+  char buf[16384];
+  for(;;) {
+    ssize_t res = ::recv(s.fd, buf, sizeof(buf), 0);
+    if(res > 0) {
+      s.in.append(buf, res);
+      if((size_t)res < sizeof(buf))
+	break;
+      continue;
+    }
+    if(res == 0) {
+      eof = true;
+      break;
+    }
+    if(errno == EINTR)
+      continue;
+    if(errno == EAGAIN || errno == EWOULDBLOCK)
+      break;
+    lost(s, "Error reading from SMTP server: "+string(strerror(errno)), true);
+    return;
+  }
+  s.deadline = getNow() + timeout(s);
+
+  // a reply is one or more lines, the last of which has a space after the code
+  vector<string> lines;
+  string reply;
+  size_t pos = 0;
+  for(;;) {
+    auto end = s.in.find('\n', pos);
+    if(end == string::npos)
+      break;
+    string line = s.in.substr(pos, end - pos);
+    if(!line.empty() && line.back() == '\r')
+      line.pop_back();
+    pos = end + 1;
+    if(line.size() < 4 || (line[3] != ' ' && line[3] != '-')) {
+      lost(s, "Invalid response from SMTP server: '"+line+"'", false);
+      return;
+    }
+    lines.push_back(line);
+    if(line[3] == '-')
+      continue;
+
+    reply.clear();
+    for(const auto& l : lines)
+      reply += (reply.empty() ? "" : " ") + l;
+    s.in.erase(0, pos);
+    pos = 0;
+    handleReply(s, atoi(reply.c_str()), reply, lines);
+    if(s.generation != generation || s.fd < 0) // this connection is gone
+      return;
+    lines.clear();
+  }
+  if(eof) {
+    if(s.state == State::Quit || (s.state == State::Ready && !s.hasjob))
+      close(s, false); // an idle connection timed out at the server, or we said QUIT
+    else
+      lost(s, "SMTP server closed the connection", true);
+  }
+}
+
+void SMTPEngine::handleEvent(Session& s, uint32_t events)
+{
+  if(s.fd < 0)
+    return;
+  if(s.state == State::Connecting) {
+    if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      return;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+      err = errno;
+    if(err) {
+      lost(s, "Could not connect to "+d_pool->getAddress(s.relay).toStringWithPort()+": "+string(strerror(err)), false);
+      return;
+    }
+    s.state = State::Greeting;
+    s.deadline = getNow() + d_timeout;
+    watch(s, false);
+    return;
+  }
+  uint64_t generation = s.generation;
+  if(events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    readReplies(s);
+  if((events & EPOLLOUT) && s.generation == generation && s.fd >= 0)
+    flush(s);
+}
+
+void SMTPEngine::run(const getjob_t& getJob, const done_t& done)
+{
+  const char* allowed="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-.@=";
+  d_done = &done;
+  bool more = true, quitting = false;
+  vector<epoll_event> events(128);
+  for(;;) {
+    double now = getNow();
+    if(d_stop)
+      more = false;
+
+    // hand out messages to sessions that do not have one, and are not waiting to ask again
+    for(auto& s : d_sessions) {
+      if(!more)
+	break;
+      if(s->hasjob || s->state == State::Quit || now < s->nextask)
+	continue;
+      s->job.msg.clear();
+      double wait = 0.25;
+      if(!getJob(s->job, s->num, wait)) {
+	if(wait < 0)
+	  more = false;
+	else
+	  s->nextask = now + std::min(wait, 0.25);
+	continue;
+      }
+      s->nextask = 0;
+      if(s->job.envelopeFrom.find_first_not_of(allowed) != string::npos || s->job.to.find_first_not_of(allowed) != string::npos) {
+	done(s->job, 553, "Illegal character in from or to address"); // no server will take it either, so do not retry
+	continue;
+      }
+      s->hasjob = true;
+      startJob(*s);
+    }
+
+    bool busy = false, connected = false;
+    for(const auto& s : d_sessions) {
+      busy |= s->hasjob;
+      connected |= s->fd >= 0;
+    }
+    if(!more && !busy) {
+      if(!quitting) { // say goodbye, and wait a little while for the servers to say it back
+	quitting = true;
+	for(auto& s : d_sessions) {
+	  if(s->fd < 0)
+	    continue;
+	  if(s->state != State::Ready) {
+	    close(*s, false);
+	    continue;
+	  }
+	  s->state = State::Quit;
+	  send(*s, "QUIT\r\n");
+	  s->deadline = getNow() + 1;
+	}
+	continue;
+      }
+      if(!connected)
+	break;
+    }
+
+    // wait for the sockets, a deadline, our next chance to get work, or a stop()
+    double until = now + 0.25;
+    for(const auto& s : d_sessions) {
+      if(s->deadline)
+	until = std::min(until, s->deadline);
+      if(more && !s->hasjob && s->state != State::Quit)
+	until = std::min(until, s->nextask);
+    }
+    int msec = std::max(0, (int)ceil((until - now) * 1000));
+    int ret = epoll_wait(d_epfd, events.data(), events.size(), msec);
+    if(ret < 0 && errno != EINTR)
+      throw std::runtime_error("epoll_wait failed: "+string(strerror(errno)));
+    for(int n = 0; n < ret; ++n)
+      handleEvent(*d_sessions.at(events[n].data.u32), events[n].events);
+
+    now = getNow();
+    for(auto& s : d_sessions) {
+      if(!s->deadline || s->deadline > now)
+	continue;
+      if(s->state == State::Quit)
+	close(*s, false);
+      else if(s->state == State::Connecting || s->state == State::Greeting || s->state == State::Ehlo)
+	lost(*s, "Timeout talking to SMTP server "+d_pool->getAddress(s->relay).toStringWithPort(), false);
+      else {
+	close(*s, false);
+	if(s->hasjob)
+	  finish(*s, 0, "Timeout waiting for SMTP server");
+      }
+    }
+  }
+  d_done = nullptr;
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "relaypool.hh"
+#include "mime.hh"
+#include "smtp.hh"
+
+//! a message for SMTPEngine, with a single recipient
+struct SMTPJob
+{
+  std::string envelopeFrom;
+  std::string to;
+  MIMEBuffers msg;    // headers and body, without the final ".", which the engine adds
+  uint64_t id{0};     // for the caller, the engine does not look at it
+  // filled out by the engine
+  SMTPTimings timings;
+  std::string relay;  // the smart host that got (or did not get) the message
+};
+
+/* Drives many SMTP sessions from a single thread, using epoll. Each session
+   is a small state machine that goes through the same steps as an
+   SMTPSession: connect, EHLO, and then for every message (RSET,) MAIL, RCPT,
+   DATA, the message itself, and the acknowledgement, with PIPELINING if the
+   server has it. Sessions connect when they get their first message, to the
+   relay the RelayPool hands out, and then stay connected.
+
+   The engine does not know where messages come from: whenever a session is
+   ready for another one, run() asks getJob for it, and it reports how each
+   message went to done. Both are called from the thread that called run().
+
+   Failures are treated like SMTPSession does: if a connection can not be
+   made, we try the other relays. If a connection gets lost, we reconnect and
+   try the message once more, unless it was lost after we sent the message.
+   If the server does not reply within 'timeout' seconds, the message fails,
+   and the connection is closed. For the reply to the message itself we wait
+   10 minutes, as RFC 5321 suggests, see setAckTimeout(). A server hanging up on a connection that was
+   idle does not count as a failure of its relay. Like SMTPSession, we
+   reconnect after a number of messages or seconds, see setRecycle().
+
+   A session that has no message and gets none from getJob is asked again
+   after the 'wait' it got, a session that just finished one is asked right
+   away. */
+class SMTPEngine
+{
+public:
+  SMTPEngine(std::shared_ptr<RelayPool> pool, unsigned int numSessions, double timeout=5);
+  ~SMTPEngine();
+  SMTPEngine(const SMTPEngine&) = delete;
+
+  //! fill out job for session number 'session', or return false with 'wait' set to the seconds until we should ask again, or to -1 if there will be no more
+  typedef std::function<bool(SMTPJob& job, unsigned int session, double& wait)> getjob_t;
+  //! error is empty if the message was accepted, code is the SMTP code, 553 for an address we will not send to, or 0 if there was no reply at all
+  typedef std::function<void(SMTPJob& job, int code, const std::string& error)> done_t;
+  //! returns once getJob says there will be no more, and every message is done, or after stop()
+  void run(const getjob_t& getJob, const done_t& done);
+  //! makes run() stop asking for messages, and return once the ones in flight are done. Safe to call from a signal handler
+  void stop()
+  {
+    d_stop = true;
+  }
+  //! say QUIT after this many messages or seconds on a connection, so the session gets a relay from the pool again
+  void setRecycle(unsigned int messages, unsigned int seconds)
+  {
+    d_recycleMessages = messages;
+    d_recycleSeconds = seconds;
+  }
+  //! seconds to wait for the reply after the final dot
+  void setAckTimeout(double seconds)
+  {
+    d_ackTimeout = seconds;
+  }
+  //! number of messages the servers accepted
+  uint64_t getNumSent() const
+  {
+    return d_numsent;
+  }
+
+private:
+  struct Session;
+  void startJob(Session& s);
+  void connect(Session& s);
+  void close(Session& s, bool failed);
+  void lost(Session& s, const std::string& why, bool eof);
+  void finish(Session& s, int code, const std::string& error);
+  void lap(Session& s, SMTPTimings::Phase phase);
+  double timeout(const Session& s) const;
+  void send(Session& s, const std::string& str);
+  void flush(Session& s);
+  void watch(Session& s, bool write);
+  void handleEvent(Session& s, uint32_t events);
+  void readReplies(Session& s);
+  void handleReply(Session& s, int code, const std::string& reply, const std::vector<std::string>& lines);
+  void startEnvelope(Session& s);
+  void envelopeReply(Session& s, int code, const std::string& reply);
+
+  std::shared_ptr<RelayPool> d_pool;
+  std::vector<std::unique_ptr<Session>> d_sessions;
+  double d_timeout;
+  double d_ackTimeout{600};
+  int d_epfd{-1};
+  const done_t* d_done{nullptr}; // only during run()
+  uint64_t d_numsent{0};
+  unsigned int d_recycleMessages{500};
+  unsigned int d_recycleSeconds{300};
+  std::atomic<bool> d_stop{false};
+};
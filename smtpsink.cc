@@ -0,0 +1,245 @@
+#include "smtpsink.hh"
+#include <algorithm>
+#include <chrono>
+#include <poll.h>
+#include <random>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+
+SMTPSink::SMTPSink(const ComboAddress& local, const SMTPSinkSettings& ss) : d_local(local), d_ss(ss)
+{
+  d_listener = socket(d_local.sin4.sin_family, SOCK_STREAM, 0);
+  if(d_listener < 0)
+    throw std::runtime_error("Unable to create socket for SMTP sink");
+  SSetsockopt(d_listener, SOL_SOCKET, SO_REUSEADDR, 1);
+  SBind(d_listener, d_local);
+  SListen(d_listener, 128);
+  socklen_t len = d_local.getSocklen();
+  getsockname(d_listener, (struct sockaddr*)&d_local, &len);
+}
+
+SMTPSink::~SMTPSink()
+{
+  d_stop = true;
+  if(d_thread.joinable())
+    d_thread.join();
+  for(auto& t : d_connections)
+    t.join();
+  close(d_listener);
+}
+
+void SMTPSink::start()
+{
+  d_thread = std::thread(&SMTPSink::acceptor, this);
+}
+
+void SMTPSink::acceptor()
+{
+  while(!d_stop) {
+    pollfd pfd{d_listener, POLLIN, 0};
+    if(poll(&pfd, 1, 100) <= 0)
+      continue;
+    ComboAddress remote;
+    remote.sin4.sin_family = d_local.sin4.sin_family;
+    int fd = SAccept(d_listener, remote);
+    std::lock_guard<std::mutex> l(d_lock);
+    d_connections.emplace_back(&SMTPSink::serve, this, fd);
+  }
+}
+
+void SMTPSink::addSample(const std::string& phase, double msec)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  d_samples[phase].push_back(msec);
+}
+
+std::vector<std::string> SMTPSink::getRecipients()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  return d_recipients;
+}
+
+std::map<std::string, std::vector<double>> SMTPSink::getPhaseStats()
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  std::map<std::string, std::vector<double>> ret;
+  for(auto& [phase, samples] : d_samples) {
+    if(samples.empty())
+      continue;
+    sort(samples.begin(), samples.end());
+    auto perc = [&](double p) { return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))]; };
+    ret[phase] = {perc(0.5), perc(0.9), perc(0.99), samples.back(), (double)samples.size()};
+  }
+  return ret;
+}
+
+/* We read whatever the client sends, answer every complete line in there, and
+   then send all replies in one go. So a pipelining client pays the latency
+   once per batch, like it would with a real server. */
+void SMTPSink::serve(int fd)
+try
+{
+  std::mt19937 rng(fd ^ time(0));
+  std::uniform_real_distribution<double> dist(0, 1);
+  using clock = std::chrono::steady_clock;
+  auto msec = [](clock::time_point a, clock::time_point b) { return std::chrono::duration<double, std::milli>(b - a).count(); };
+
+  auto start = clock::now(), mailStart = start, dataStart = start, replied = start;
+  bool gotEhlo = false, inData = false, waitingForClient = false, hangup = false;
+  unsigned int rcpts = 0;
+  string rcpt; // the last one we accepted
+  uint64_t bytes = 0;
+
+  string in, out = "220 ckmailer sink ESMTP\r\n";
+  auto reject = [&]() -> const char* {
+    double r = dist(rng);
+    if(r < d_ss.permFail)
+      return "550 5.1.1 Rejected by sink\r\n";
+    if(r < d_ss.permFail + d_ss.tempFail)
+      return "451 4.3.0 Try again later, says the sink\r\n";
+    return nullptr;
+  };
+
+  auto active = start;
+  for(;;) {
+    if(!out.empty()) {
+      if(d_ss.latencyMsec)
+	std::this_thread::sleep_for(std::chrono::milliseconds(d_ss.latencyMsec));
+      SWriten(fd, out);
+      out.clear();
+      replied = clock::now();
+    }
+
+    pollfd pfd{fd, POLLIN, 0};
+    int res = poll(&pfd, 1, 100);
+    if(d_stop)
+      break;
+    if(res <= 0) {
+      if(d_ss.idleMsec && !inData && msec(active, clock::now()) >= d_ss.idleMsec) {
+	SWriten(fd, "421 4.4.2 ckmailer sink Error: timeout exceeded\r\n");
+	break;
+      }
+      continue;
+    }
+    active = clock::now();
+    char buf[16384];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if(len <= 0)
+      break;
+    in.append(buf, len);
+
+    size_t pos = 0, eol;
+    bool quit = false;
+    while((eol = in.find('\n', pos)) != string::npos) {
+      string_view line(in.data() + pos, eol + 1 - pos);
+      pos = eol + 1;
+      auto now = clock::now();
+      if(inData) {
+	if(line != ".\r\n" && line != ".\n") {
+	  bytes += line.size();
+	  continue;
+	}
+	inData = false;
+	if(hangup) { // without a word
+	  quit = true;
+	  break;
+	}
+	addSample("body", msec(dataStart, now));
+	const char* rej = d_ss.failAfterData ? reject() : nullptr;
+	if(rej) {
+	  out += rej;
+	  d_rejected++;
+	}
+	else {
+	  if(d_ss.ackMsec)
+	    std::this_thread::sleep_for(std::chrono::milliseconds(d_ss.ackMsec));
+	  out += "250 2.0.0 Ok: queued\r\n";
+	  d_messages++;
+	  if(d_ss.keepRecipients) {
+	    std::lock_guard<std::mutex> l(d_lock);
+	    d_recipients.push_back(rcpt);
+	  }
+	  d_bytes += bytes;
+	}
+	waitingForClient = true;
+	continue;
+      }
+
+      string cmd(line.substr(0, std::min(line.size(), (size_t)4)));
+      for(auto& c : cmd)
+	c = toupper(c);
+      if(waitingForClient && (cmd == "MAIL" || cmd == "RSET")) {
+	addSample("client", msec(replied, now));
+	waitingForClient = false;
+      }
+
+      if(cmd == "EHLO" || cmd == "HELO") {
+	if(!gotEhlo)
+	  addSample("setup", msec(start, now));
+	gotEhlo = true;
+	out += d_ss.pipelining ? "250-ckmailer sink\r\n250-PIPELINING\r\n250 8BITMIME\r\n" : "250-ckmailer sink\r\n250 8BITMIME\r\n";
+      }
+      else if(cmd == "MAIL") {
+	mailStart = now;
+	rcpts = 0;
+	hangup = false;
+	out += "250 2.1.0 Ok\r\n";
+      }
+      else if(cmd == "RCPT") {
+	string_view to = line.substr(std::min(line.find('<') + 1, line.size()));
+	const char* rej = d_ss.failAfterData ? nullptr : reject();
+	if(to.starts_with("tempfail"))
+	  rej = "451 4.3.0 Try again later, says the sink\r\n";
+	else if(to.starts_with("permfail"))
+	  rej = "550 5.1.1 Rejected by sink\r\n";
+	else if(to.starts_with("hangup"))
+	  hangup = true;
+	if(rej) {
+	  out += rej;
+	  d_rejected++;
+	}
+	else {
+	  out += "250 2.1.5 Ok\r\n";
+	  rcpts++;
+	  rcpt = to.substr(0, to.find('>'));
+	}
+      }
+      else if(cmd == "DATA") {
+	if(!rcpts)
+	  out += "554 5.5.1 No valid recipients\r\n";
+	else {
+	  addSample("envelope", msec(mailStart, now));
+	  out += "354 End data with <CR><LF>.<CR><LF>\r\n";
+	  inData = true;
+	  dataStart = now;
+	  bytes = 0;
+	}
+      }
+      else if(cmd == "RSET") {
+	rcpts = 0;
+	out += "250 2.0.0 Ok\r\n";
+      }
+      else if(cmd == "NOOP")
+	out += "250 2.0.0 Ok\r\n";
+      else if(cmd == "QUIT") {
+	out += "221 2.0.0 Bye\r\n";
+	quit = true;
+	break;
+      }
+      else
+	out += "500 5.5.2 Error: command not recognized\r\n";
+    }
+    in.erase(0, pos);
+    if(quit) {
+      SWriten(fd, out);
+      break;
+    }
+  }
+  close(fd);
+}
+catch(std::exception&)
+{
+  close(fd);
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "swrappers.hh"
+
+/* A fake smart host, for testing and benchmarking without sending mail to
+   anyone. It speaks just enough SMTP for SMTPSession (EHLO, MAIL, RCPT, DATA,
+   RSET, QUIT), optionally with PIPELINING, and throws the messages away.
+
+   To look like a real relay on the other side of a network, it can wait
+   latencyMsec before sending each batch of replies, and it can reject a
+   fraction of recipients (or messages, after DATA) with a 4xx or 5xx reply.
+   For tests, recipients that start with 'tempfail' or 'permfail' always get
+   a 451 or a 550, and a message to a recipient that starts with 'hangup'
+   makes the sink hang up at the final dot, without a reply. With idleMsec,
+   it says 421 to clients that send nothing for that long, like Postfix, and
+   with ackMsec it takes that much longer to accept a message.
+
+   Per connection it times the phases it can see: from accept to EHLO (setup),
+   from MAIL to DATA (envelope), from DATA to the final dot (body), and from
+   our reply to the next MAIL or RSET (client, which is how long the client
+   spent preparing the next message). */
+
+struct SMTPSinkSettings
+{
+  bool pipelining{true};
+  unsigned int latencyMsec{0};
+  double tempFail{0};  // fraction of recipients that get a 451
+  double permFail{0};  // fraction of recipients that get a 550
+  bool failAfterData{false}; // reject at the final dot instead of at RCPT
+  unsigned int idleMsec{0};  // if set, hang up on idle clients after this long, with a 421
+  unsigned int ackMsec{0};   // extra time we take to accept a message, like a relay that scans it
+  bool keepRecipients{false}; // for tests, see getRecipients()
+};
+
+class SMTPSink
+{
+public:
+  //! listens right away, use port 0 for any free port, getLocal() tells you which one it got
+  SMTPSink(const ComboAddress& local, const SMTPSinkSettings& ss);
+  ~SMTPSink();
+  SMTPSink(const SMTPSink&) = delete;
+
+  ComboAddress getLocal() const
+  {
+    return d_local;
+  }
+  //! accepts connections in a background thread, each connection gets its own thread
+  void start();
+
+  uint64_t getNumMessages() const
+  {
+    return d_messages;
+  }
+  uint64_t getNumBytes() const
+  {
+    return d_bytes;
+  }
+  uint64_t getNumRejected() const
+  {
+    return d_rejected;
+  }
+  //! the recipients of the messages we accepted, in that order, if keepRecipients is set
+  std::vector<std::string> getRecipients();
+  //! phase name -> p50, p90, p99 and max in milliseconds, and the number of samples
+  std::map<std::string, std::vector<double>> getPhaseStats();
+
+private:
+  void acceptor();
+  void serve(int fd);
+  void addSample(const std::string& phase, double msec);
+
+  ComboAddress d_local;
+  SMTPSinkSettings d_ss;
+  int d_listener;
+  std::thread d_thread;
+  std::atomic<bool> d_stop{false};
+  std::atomic<uint64_t> d_messages{0}, d_bytes{0}, d_rejected{0};
+
+  std::mutex d_lock; // protects d_samples, d_recipients and d_connections
+  std::map<std::string, std::vector<double>> d_samples;
+  std::vector<std::string> d_recipients;
+  std::vector<std::thread> d_connections;
+};
@@ -0,0 +1,126 @@
+#include "spool.hh"
+#include <fmt/format.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static int openDir(int at, const std::string& dir, const std::string& name, bool create)
+{
+  if(create && mkdirat(at, name.c_str(), 0700) < 0 && errno != EEXIST)
+    throw std::runtime_error("Could not create "+dir+"/"+name+": "+string(strerror(errno)));
+  int fd = openat(at, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd < 0)
+    throw std::runtime_error("Could not open spool directory "+dir+"/"+name+": "+string(strerror(errno)));
+  return fd;
+}
+
+MaildirSpool::MaildirSpool(const std::string& dir) : d_dir(dir)
+{
+  char hostname[256]="";
+  gethostname(hostname, sizeof(hostname)-1);
+  d_hostname = hostname;
+  // '/' and ':' have a meaning in Maildir names
+  for(auto& c : d_hostname)
+    if(c == '/' || c == ':')
+      c = '_';
+
+  try {
+    d_dirfd = openDir(AT_FDCWD, dir, dir, false);
+    d_tmpfd = openDir(d_dirfd, dir, "tmp", true);
+    d_newfd = openDir(d_dirfd, dir, "new", true);
+    d_envfd = openDir(d_dirfd, dir, "env", true);
+  }
+  catch(...) {
+    for(int fd : {d_dirfd, d_tmpfd, d_newfd, d_envfd})
+      if(fd >= 0)
+	close(fd);
+    throw;
+  }
+}
+
+// only the caller knows if what it add()ed should go out, for example because it can mark the rows as sent right after, so we do not commit it
+MaildirSpool::~MaildirSpool()
+{
+  for(const auto& fname : d_pending) {
+    unlinkat(d_tmpfd, (fname + ".env").c_str(), 0);
+    unlinkat(d_tmpfd, fname.c_str(), 0);
+  }
+  for(int fd : {d_dirfd, d_tmpfd, d_newfd, d_envfd})
+    close(fd);
+}
+
+static void writeFile(int dirfd, const std::string& name, const MIMEBuffers& content)
+{
+  int fd = openat(dirfd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if(fd < 0)
+    throw std::runtime_error("Could not create spool file tmp/"+name+": "+string(strerror(errno)));
+  try {
+    content.writeTo(fd, 5);
+  }
+  catch(...) {
+    close(fd);
+    unlinkat(dirfd, name.c_str(), 0);
+    throw;
+  }
+  if(close(fd) < 0)
+    throw std::runtime_error("Could not write spool file tmp/"+name+": "+string(strerror(errno)));
+}
+
+void MaildirSpool::add(const std::string& name, const std::string& envelopeFrom, const std::string& to, const MIMEBuffers& msg)
+{
+  string fname = fmt::format("{}.{}.{}", time(nullptr), name, d_hostname);
+  MIMEBuffers env;
+  env.appendf("envelope-from {}\nrecipient {}\n", envelopeFrom, to);
+  writeFile(d_tmpfd, fname + ".env", env);
+  try {
+    writeFile(d_tmpfd, fname, msg);
+  }
+  catch(...) {
+    unlinkat(d_tmpfd, (fname + ".env").c_str(), 0);
+    throw;
+  }
+  d_pending.push_back(fname);
+}
+
+void MaildirSpool::commit()
+{
+  if(d_pending.empty())
+    return;
+  size_t n = 0;
+  string error;
+  // one syncfs for the whole batch, instead of an fsync per file
+  if(syncfs(d_tmpfd) < 0)
+    error = "Could not sync spool "+d_dir+": "+string(strerror(errno));
+  else {
+    for(; n < d_pending.size(); ++n) {
+      const auto& fname = d_pending[n];
+      // the envelope first, so it is there once the MTA sees the message
+      if(renameat(d_tmpfd, (fname + ".env").c_str(), d_envfd, fname.c_str()) < 0) {
+	error = "Could not move "+fname+" into spool "+d_dir+": "+string(strerror(errno));
+	break;
+      }
+      if(renameat(d_tmpfd, fname.c_str(), d_newfd, fname.c_str()) < 0) {
+	error = "Could not move "+fname+" into spool "+d_dir+": "+string(strerror(errno));
+	unlinkat(d_envfd, fname.c_str(), 0);
+	break;
+      }
+    }
+    if(error.empty() && (fsync(d_envfd) < 0 || fsync(d_newfd) < 0))
+      error = "Could not sync spool "+d_dir+": "+string(strerror(errno));
+  }
+  if(!error.empty()) {
+    for(size_t m = n; m < d_pending.size(); ++m) {
+      unlinkat(d_tmpfd, (d_pending[m] + ".env").c_str(), 0);
+      unlinkat(d_tmpfd, d_pending[m].c_str(), 0);
+    }
+    d_pending.clear();
+    throw SpoolError(error, n);
+  }
+  d_pending.clear();
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "mime.hh"
+
+struct SpoolError : public std::runtime_error
+{
+  SpoolError(const std::string& what, size_t delivered) : std::runtime_error(what), d_delivered(delivered)
+  {}
+  size_t d_delivered; // the first this many of the batch did get delivered
+};
+
+/* Hands messages to a local MTA through a Maildir-style pickup directory,
+   instead of an SMTP conversation. A message is written to dir/tmp, and once
+   it is safely on disk, renamed into dir/new, so the MTA never sees half a
+   message. The envelope goes into a file with the same name in dir/env,
+   which is renamed into place before the message is:
+
+     envelope-from bmailer+xyz@hubertnet.nl
+     recipient you@example.com
+
+   The message is what we would have sent after DATA, with \r\n line endings,
+   without the final ".". It is not dot-stuffed, our encoders already make sure
+   no line starts with a dot.
+
+   An fsync per message would limit us to a few hundred messages per second,
+   so add() only writes the files, and commit() makes a whole batch durable
+   with a single syncfs() before renaming them, and then an fsync of the two
+   directories. Messages are only delivered once commit() returns. If we
+   crash before that, what is left in tmp/ can be removed. If commit() fails,
+   it removes what it did not get to from tmp/, and says how many made it.
+   What is not committed when the MaildirSpool is destroyed gets removed too.
+
+   Not thread safe, but any number of MaildirSpools, also in different
+   processes, can share a directory, as long as the names they pass to add()
+   are unique. */
+class MaildirSpool
+{
+public:
+  //! creates tmp, new and env in dir if needed, dir itself must exist
+  explicit MaildirSpool(const std::string& dir);
+  ~MaildirSpool();
+  MaildirSpool(const MaildirSpool&) = delete;
+
+  //! writes msg to tmp/, name must be unique, and is extended to the usual Maildir form
+  void add(const std::string& name, const std::string& envelopeFrom, const std::string& to, const MIMEBuffers& msg);
+  //! makes everything add()ed so far durable and visible to the MTA, throws a SpoolError if that did not work out
+  void commit();
+  //! number of messages add()ed since the last commit()
+  size_t size() const
+  {
+    return d_pending.size();
+  }
+
+private:
+  std::string d_dir;
+  std::string d_hostname;
+  int d_dirfd{-1}, d_tmpfd{-1}, d_newfd{-1}, d_envfd{-1};
+  std::vector<std::string> d_pending; // file names in tmp/, the envelopes have ".env" appended
+};
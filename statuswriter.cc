@@ -0,0 +1,99 @@
+#include "statuswriter.hh"
+#include <chrono>
+#include <fmt/core.h>
+
+using namespace std;
+
+StatusWriter::StatusWriter(SQLiteWriter& db, const std::string& owner, unsigned int batch, unsigned int msec) : d_db(db), d_owner(owner), d_batch(batch ? batch : 1), d_msec(msec)
+{
+  d_thread = std::thread(&StatusWriter::worker, this);
+}
+
+StatusWriter::~StatusWriter()
+{
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    d_pleasequit = true;
+  }
+  d_cond.notify_one();
+  d_thread.join();
+  flush();
+}
+
+void StatusWriter::add(Outcome&& o)
+{
+  std::lock_guard<std::mutex> l(d_lock);
+  d_outcomes.push_back(std::move(o));
+  if(d_outcomes.size() >= d_batch)
+    d_cond.notify_one();
+}
+
+void StatusWriter::markSent(const std::string& queueId)
+{
+  add({queueId, true, 0, 0, false, ""});
+}
+
+void StatusWriter::markFailed(const std::string& queueId, int64_t attempts, time_t nextAttempt, bool permanent, const std::string& error)
+{
+  add({queueId, false, attempts, nextAttempt, permanent, error});
+}
+
+void StatusWriter::flush()
+{
+  std::unique_lock<std::mutex> l(d_lock);
+  if(!d_outcomes.empty())
+    commit(l);
+}
+
+void StatusWriter::worker()
+{
+  std::unique_lock<std::mutex> l(d_lock);
+  while(!d_pleasequit) {
+    d_cond.wait_for(l, std::chrono::milliseconds(d_msec), [this]() { return d_pleasequit || d_outcomes.size() >= d_batch; });
+    if(!d_outcomes.empty())
+      commit(l);
+  }
+}
+
+// called with 'lock' held, releases it while talking to the database
+void StatusWriter::commit(std::unique_lock<std::mutex>& lock)
+{
+  vector<Outcome> outcomes;
+  outcomes.swap(d_outcomes);
+  lock.unlock();
+
+  bool ok = true;
+  vector<string> lost;
+  {
+    std::lock_guard<std::mutex> cl(d_commitlock);
+    try {
+      d_db.queryT("begin");
+      for(const auto& o : outcomes) {
+	// if our lease expired, the row may belong to another runner by now, and then its outcome is not ours to write
+	vector<unordered_map<string, MiniSQLite::outvar_t>> res;
+	if(o.sent)
+	  res = d_db.queryT("update queue set sent=1 where id=? and sent=0 and leaseOwner=? returning id", {o.queueId, d_owner});
+	else
+	  res = d_db.queryT("update queue set attempts=?, nextAttempt=?, failed=?, lastError=?, leaseOwner='', leaseExpiry=0 where id=? and sent=0 and leaseOwner=? returning id",
+			    {o.attempts, (int64_t)o.nextAttempt, (int64_t)o.permanent, o.error, o.queueId, d_owner});
+	if(res.empty())
+	  lost.push_back(o.queueId);
+      }
+      d_db.queryT("commit");
+    }
+    catch(std::exception& e) {
+      fmt::print("Failed to record delivery status of {} messages, will retry: {}\n", outcomes.size(), e.what());
+      try {
+	d_db.queryT("rollback");
+      }
+      catch(...) {}
+      ok = false;
+    }
+  }
+  if(ok)
+    for(const auto& id : lost)
+      fmt::print("Lost our lease on queue row {} before we could record how it went, another runner may send it again\n", id);
+  lock.lock();
+  if(!ok)
+    d_outcomes.insert(d_outcomes.begin(), std::make_move_iterator(outcomes.begin()), std::make_move_iterator(outcomes.end()));
+}
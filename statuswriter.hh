@@ -0,0 +1,74 @@
+#pragma once
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sqlwriter.hh"
+
+/* Our database runs without transactions, so every 'update queue set sent=1'
+   would cost an fsync. The StatusWriter collects delivery outcomes instead, and
+   writes them in a single transaction once it has 'batch' of them, or when
+   'msec' milliseconds have passed since the last commit, whichever comes first.
+
+   Crash safety: an outcome only hits the disk once its transaction commits.
+   If we crash (or get killed) before that, the rows involved are still unsent
+   according to the database, and the next run will send them again. So a crash
+   can cause at most 'batch' messages, or 'msec' milliseconds worth of messages,
+   to be delivered twice. With batch=1 there is no such window, but you pay the
+   fsync for every message again.
+
+   Outcomes are only written for rows that still carry our name as their
+   'leaseOwner'. If our lease expired and another runner claimed a row, that
+   runner gets to decide what happens to it, and we print that we lost it.
+
+   Thread safe, and flushes on destruction.
+*/
+class StatusWriter
+{
+public:
+  //! owner is the name the runner puts on the leases of the rows it claims
+  StatusWriter(SQLiteWriter& db, const std::string& owner, unsigned int batch, unsigned int msec);
+  ~StatusWriter();
+  StatusWriter(const StatusWriter&) = delete;
+
+  void markSent(const std::string& queueId);
+  //! records a failed attempt, the row will be retried at nextAttempt, unless the failure is permanent
+  void markFailed(const std::string& queueId, int64_t attempts, time_t nextAttempt, bool permanent, const std::string& error);
+  //! blocks until everything reported so far is committed
+  void flush();
+
+  //! runs f while we are not in a transaction, so it can not get rolled back with one of ours
+  template<typename F>
+  void exclusive(F f)
+  {
+    std::lock_guard<std::mutex> cl(d_commitlock);
+    f();
+  }
+
+private:
+  struct Outcome
+  {
+    std::string queueId;
+    bool sent;
+    int64_t attempts;
+    time_t nextAttempt;
+    bool permanent;
+    std::string error;
+  };
+  void add(Outcome&& o);
+  void worker();
+  void commit(std::unique_lock<std::mutex>& lock);
+
+  SQLiteWriter& d_db;
+  std::string d_owner;
+  unsigned int d_batch;
+  unsigned int d_msec;
+
+  std::mutex d_commitlock; // only one transaction at a time on d_db
+  std::mutex d_lock; // protects everything below
+  std::condition_variable d_cond;
+  std::vector<Outcome> d_outcomes;
+  bool d_pleasequit{false};
+  std::thread d_thread;
+};
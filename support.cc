@@ -5,33 +5,99 @@
 #include <fmt/chrono.h>
 #include <sys/stat.h>
 #include <vector>
-#include <random>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <pthread.h>
+#include <sys/random.h>
 #include <sclasses.hh>
 #include <regex>
+#include <array>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "base64.hpp"
 using namespace std;
 
+namespace {
+  // bumped in the child after a fork, so it does not hand out the same random bytes as its parent
+  std::atomic<unsigned int> g_forkgen{0};
+
+  /* getrandom() costs a syscall, so each thread fetches a few KB of the kernel's
+     CSPRNG output at a time, and hands that out. There is no state to predict
+     here, and a fresh batch comes straight from the kernel, which reseeds itself. */
+  class RandomPool
+  {
+  public:
+    void get(void* dst, size_t len)
+    {
+      if(d_forkgen != g_forkgen) {
+	d_pos = sizeof(d_buf);
+	d_forkgen = g_forkgen;
+      }
+      auto ptr = (unsigned char*)dst;
+      while(len) {
+	if(d_pos == sizeof(d_buf))
+	  refill();
+	size_t chunk = std::min(len, sizeof(d_buf) - d_pos);
+	memcpy(ptr, d_buf + d_pos, chunk);
+	memset(d_buf + d_pos, 0, chunk); // what we handed out, we forget
+	d_pos += chunk;
+	ptr += chunk;
+	len -= chunk;
+      }
+    }
+
+  private:
+    void refill()
+    {
+      static std::once_flag once;
+      std::call_once(once, []() { pthread_atfork(nullptr, nullptr, []() { g_forkgen++; }); });
+      for(size_t got = 0; got < sizeof(d_buf); ) {
+	ssize_t res = getrandom(d_buf + got, sizeof(d_buf) - got, 0);
+	if(res < 0) {
+	  if(errno == EINTR)
+	    continue;
+	  throw std::runtime_error("getrandom failed: "+string(strerror(errno)));
+	}
+	got += res;
+      }
+      d_pos = 0;
+    }
+    unsigned char d_buf[4096];
+    size_t d_pos{sizeof(d_buf)};
+    unsigned int d_forkgen{0};
+  };
+
+  thread_local RandomPool t_randompool;
+}
+
 uint64_t getRandom64()
 {
-  static std::random_device rd; // 32 bits at a time. At least on recent Linux and gcc this does not block
-  return ((uint64_t)rd() << 32) | rd();
+  uint64_t ret;
+  t_randompool.get(&ret, sizeof(ret));
+  return ret;
 }
 
+// 128 bits, as 22 characters of base64url without padding
 string getLargeId()
 {
-  uint64_t id = getRandom64();
-  string ret = base64::to_base64(std::string((char*)&id, sizeof(id)));
-  ret.resize(ret.size()-1); // this base64url implementation pads, somehow
-  id = getRandom64();
-  ret += base64::to_base64(std::string((char*)&id, sizeof(id)));
-  ret.resize(ret.size()-1); // this base64url implementation pads, somehow
-
-  for(auto& c : ret) {
-    if(c == '/')
-      c = '_';
-    else if(c == '+')
-      c = '-';
+  static constexpr char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+  unsigned char id[16];
+  t_randompool.get(id, sizeof(id));
+
+  string ret(22, ' ');
+  char* out = ret.data();
+  for(int n = 0; n < 15; n += 3, out += 4) {
+    uint32_t v = (id[n] << 16) | (id[n + 1] << 8) | id[n + 2];
+    out[0] = chars[v >> 18];
+    out[1] = chars[(v >> 12) & 0x3f];
+    out[2] = chars[(v >> 6) & 0x3f];
+    out[3] = chars[v & 0x3f];
   }
+  out[0] = chars[id[15] >> 2];
+  out[1] = chars[(id[15] & 0x3) << 4];
   return ret;
 }
 
@@ -57,36 +123,225 @@ string getContentsOfFile(const std::string& fname)
 }
 
 
-// do not put \r in in
-string toQuotedPrintable(const std::string& in)
+namespace {
+  enum QPClass : uint8_t { QPLiteral, QPSpace, QPEscape, QPNewline };
+
+  // RFC 2045 section 6.7: 33-60 and 62-126 can go as they are, spaces and tabs too, unless at the end of a line
+  constexpr std::array<uint8_t, 256> makeQPTable()
+  {
+    std::array<uint8_t, 256> ret{};
+    for(int c = 0; c < 256; ++c) {
+      if(c == '\n' || c == '\r')
+	ret[c] = QPNewline;
+      else if(c == ' ' || c == '\t')
+	ret[c] = QPSpace;
+      else if(c >= 33 && c <= 126 && c != '=')
+	ret[c] = QPLiteral;
+      else
+	ret[c] = QPEscape;
+    }
+    return ret;
+  }
+  constexpr auto qptable = makeQPTable();
+
+  // number of bytes from pos on that are printable (including space) and not '='
+  size_t qpSafeRun(std::string_view in, size_t pos)
+  {
+    size_t start = pos;
+#if defined(__SSE2__)
+    const __m128i lo = _mm_set1_epi8(31), hi = _mm_set1_epi8(127), eq = _mm_set1_epi8('=');
+    while(pos + 16 <= in.size()) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(in.data() + pos));
+      // bytes >= 128 are negative here, so they fail the first comparison
+      __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+      ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, eq), ok);
+      unsigned int mask = _mm_movemask_epi8(ok);
+      if(mask != 0xffff)
+	return pos - start + __builtin_ctz(~mask);
+      pos += 16;
+    }
+#endif
+    while(pos < in.size() && (qptable[(unsigned char)in[pos]] == QPLiteral || in[pos] == ' '))
+      ++pos;
+    return pos - start;
+  }
+}
+
+/* Lines are at most 76 characters, including the '=' of a soft line break.
+   A \n (or \r\n) in the input becomes a \r\n line break. We escape spaces and tabs
+   at the end of a line, and a '.' at the start of a line, so the result can go
+   into an SMTP DATA section without dot stuffing. */
+void appendQuotedPrintable(std::string& out, std::string_view in)
 {
-  string out;
-  string line;
-
-  for(const auto& c: in) {
-    if(c=='\n') {
-      out += line;
-      out += "\r\n"; // really
-      line.clear();
-      continue;
+  constexpr size_t maxcol = 75;
+  static constexpr char hex[] = "0123456789ABCDEF";
+  out.reserve(out.size() + in.size() + in.size() / 8 + 16);
+
+  size_t col = 0;
+  for(size_t pos = 0; pos < in.size(); ) {
+    // the fast path, for runs of text that need no escaping. We leave the last
+    // byte of a run to the slow path, as it could be whitespace at the end of a line
+    size_t run = qpSafeRun(in, pos);
+    if(run > 1) {
+      run--;
+      while(run) {
+	if(col == maxcol) {
+	  out.append("=\r\n");
+	  col = 0;
+	}
+	if(!col && in[pos] == '.')
+	  break;
+	size_t len = std::min(run, maxcol - col);
+	out.append(in.data() + pos, len);
+	col += len;
+	pos += len;
+	run -= len;
+      }
     }
-    string part;
-    if(isprint(c) && c != '=' && c != '.')
-      part=c;
-    else
-      part = fmt::sprintf("=%02X", (int)(unsigned char)c);
-    
-    if(line.length() + part.length() >= 76) {
-      out += line;
-      out += "=\r\n";
-      line.clear();
+
+    unsigned char c = in[pos];
+    auto cl = qptable[c];
+    if(cl == QPNewline) {
+      if(c == '\n' || (pos + 1 < in.size() && in[pos + 1] == '\n')) {
+	if(c == '\r')
+	  ++pos;
+	out.append("\r\n");
+	col = 0;
+	++pos;
+	continue;
+      }
+      cl = QPEscape; // a lone \r
+    }
+    else if(cl == QPSpace) {
+      size_t next = pos + 1;
+      if(next < in.size() && in[next] == '\r')
+	++next;
+      if(next == in.size() || in[next] == '\n')
+	cl = QPEscape;
+    }
+
+    size_t width = cl == QPEscape ? 3 : 1;
+    if(col + width > maxcol) {
+      out.append("=\r\n");
+      col = 0;
     }
-    line += part;
+    if(c == '.' && !col)
+      cl = QPEscape, width = 3;
+
+    if(cl == QPEscape) {
+      out.push_back('=');
+      out.push_back(hex[c >> 4]);
+      out.push_back(hex[c & 0xf]);
+    }
+    else
+      out.push_back(c);
+    col += width;
+    ++pos;
   }
-  out += line;
+}
+
+string toQuotedPrintable(const std::string& in)
+{
+  string out;
+  appendQuotedPrintable(out, in);
   return out;
 }
 
+namespace {
+  constexpr char b64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  // 3 bytes in, 4 characters out
+  inline void b64Triplet(const unsigned char* in, char* out)
+  {
+    uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+    out[0] = b64chars[v >> 18];
+    out[1] = b64chars[(v >> 12) & 0x3f];
+    out[2] = b64chars[(v >> 6) & 0x3f];
+    out[3] = b64chars[v & 0x3f];
+  }
+
+  // a full line, 57 bytes in, 76 characters out
+  void b64LineScalar(const unsigned char* in, char* out)
+  {
+    for(int n = 0; n < 19; ++n)
+      b64Triplet(in + 3 * n, out + 4 * n);
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  /* Wojciech Muła's pshufb base64 encoder: 12 bytes in, 16 characters out.
+     It reads 16 bytes though, so the caller must make sure those are there. */
+  __attribute__((target("ssse3"))) inline __m128i b64Block(__m128i in)
+  {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t1, t3);
+
+    // maps 0-25 to 13, 26-51 to 0, and 52-63 to 1-12, as an index into the offsets
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					  '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    result = _mm_shuffle_epi8(offsets, result);
+    return _mm_add_epi8(result, indices);
+  }
+
+  // 4 blocks of 12 bytes, and 9 bytes the old way. Reads up to 52 bytes, so never past the line
+  __attribute__((target("ssse3"))) void b64LineSSSE3(const unsigned char* in, char* out)
+  {
+    for(int n = 0; n < 4; ++n)
+      _mm_storeu_si128((__m128i*)(out + 16 * n), b64Block(_mm_loadu_si128((const __m128i*)(in + 12 * n))));
+    for(int n = 0; n < 3; ++n)
+      b64Triplet(in + 48 + 3 * n, out + 64 + 4 * n);
+  }
+
+  auto b64Line = []() {
+    __builtin_cpu_init(); // we may run before the constructor that does this
+    return __builtin_cpu_supports("ssse3") ? b64LineSSSE3 : b64LineScalar;
+  }();
+#else
+  auto b64Line = b64LineScalar;
+#endif
+}
+
+/* MIME wants base64 in lines of at most 76 characters. This writes those
+   lines, each ending with \r\n, straight into out, without first encoding
+   everything into one long line. */
+void appendBase64Lines(std::string& out, std::string_view in)
+{
+  const size_t inlen = 57, linelen = 76;
+  size_t chars = 4 * ((in.size() + 2) / 3);
+  size_t pos = out.size();
+  out.resize(pos + chars + 2 * ((chars + linelen - 1) / linelen));
+  char* dst = out.data() + pos;
+
+  auto src = (const unsigned char*)in.data();
+  size_t left = in.size();
+  for(; left >= inlen; left -= inlen, src += inlen, dst += linelen + 2) {
+    b64Line(src, dst);
+    dst[linelen] = '\r';
+    dst[linelen + 1] = '\n';
+  }
+  if(!left)
+    return;
+
+  for(; left >= 3; left -= 3, src += 3, dst += 4)
+    b64Triplet(src, dst);
+  if(left) {
+    unsigned char last[3] = {src[0], left == 2 ? src[1] : (unsigned char)0, 0};
+    b64Triplet(last, dst);
+    dst[3] = '=';
+    if(left == 1)
+      dst[2] = '=';
+    dst += 4;
+  }
+  dst[0] = '\r';
+  dst[1] = '\n';
+}
+
 std::vector<std::string> splitString(const std::string& str, const std::string& delimiter) {
     std::vector<std::string> tokens;
     std::regex regex(delimiter);  // Create regex from the delimiter string
@@ -121,153 +376,32 @@ bool endsWith(const std::string& str, const std::string& suffix) {
     return std::equal(suffix.rbegin(), suffix.rend(), str.rbegin());
 }
 
-
-void sendEmail(const std::string& server, const std::string& from, const std::string& to, const std::string& subject, const std::string& textBody, const std::string& htmlBody, const std::string& bcc, const std::string& envelopeFrom, const std::vector<std::pair<std::string, std::string>>& att,
-	       const std::vector<std::pair<std::string, std::string>>& headers)
+/* Local time, as "2026-10-18 07:00", or just "07:00" for the first time it
+   is 07:00 after 'now', which may be tomorrow. */
+time_t parseLocalTime(const std::string& str, time_t now)
 {
-  string rEnvelopeFrom = envelopeFrom.empty() ? from : envelopeFrom;
-
-  const char* allowed="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-.@=";
-  if(from.find_first_not_of(allowed) != string::npos || to.find_first_not_of(allowed) != string::npos) {
-    throw std::runtime_error("Illegal character in from or to address");
-  }
-
-  ComboAddress mailserver(server, 25);
-  Socket s(mailserver.sin4.sin_family, SOCK_STREAM);
-
-  SocketCommunicator sc(s);
-  sc.connect(mailserver);
-  string line;
-  auto sponge= [&](int expected) {
-    while(sc.getLine(line)) {
-      if(line.size() < 4)
-        throw std::runtime_error("Invalid response from SMTP server: '"+line+"'");
-      if(stoi(line.substr(0,3)) != expected)
-        throw std::runtime_error("Unexpected response from SMTP server: '"+line+"'");
-      if(line.at(3) == ' ')
-        break;
-    }
-  };
-
-  sponge(220);
-  sc.writen("EHLO outer2.berthub.eu\r\n");
-  sponge(250);
-
-  sc.writen("MAIL From:<"+rEnvelopeFrom+">\r\n");
-  sponge(250);
-
-  sc.writen("RCPT To:<"+to+">\r\n");
-  sponge(250);
-
-  if(!bcc.empty()) {
-    sc.writen("RCPT To:<"+ bcc +">\r\n");
-    sponge(250);
-  }
-  
-  sc.writen("DATA\r\n");
-  sponge(354);
-  sc.writen("From: "+from+"\r\n");
-  sc.writen("To: "+to+"\r\n");
-
-  bool needb64 = false;
-  for(const auto& c : subject) {
-    if(c < 32 || (unsigned char)c > 127) {
-      needb64 = true;
-      break;
-    }
-  }
-  string esubject;
-  if(needb64)
-    esubject = "=?utf-8?B?"+base64::to_base64(subject)+"?=";
-  else
-    esubject = subject;
-
-  
-  sc.writen("Subject: "+esubject+"\r\n");
-
-  for(const auto& h : headers) {
-    sc.writen(h.first+": "+h.second+"\r\n");
+  struct tm tm={0};
+  localtime_r(&now, &tm);
+  const char* p = strptime(str.c_str(), "%Y-%m-%d %H:%M", &tm);
+  bool timeonly = false;
+  if(!p || *p) {
+    localtime_r(&now, &tm);
+    p = strptime(str.c_str(), "%H:%M", &tm);
+    if(!p || *p)
+      throw std::runtime_error("Could not parse time '"+str+"', use 'YYYY-MM-DD HH:MM' or 'HH:MM'");
+    timeonly = true;
   }
-
-  sc.writen(fmt::format("Message-Id: <{}@opentk.hostname>\r\n", getRandom64()));
-  
-  //Date: Thu, 28 Dec 2023 14:31:37 +0100 (CET)
-  sc.writen(fmt::format("Date: {:%a, %d %b %Y %H:%M:%S %z (%Z)}\r\n", fmt::localtime(time(0))));
-
-  sc.writen("Auto-Submitted: auto-generated\r\nPrecedence: bulk\r\n");
-
-  string sepa="_----------=_MCPart_"+getLargeId();
-  if(htmlBody.empty()) {
-    sc.writen("Content-Type: text/plain; charset=\"utf-8\"\r\n");
-    sc.writen("Content-Transfer-Encoding: quoted-printable\r\n");
-  }
-  else {
-    sc.writen("Content-Type: multipart/alternative; boundary=\""+sepa+"\"\r\n");
-    sc.writen("MIME-Version: 1.0\r\n");
-  }
-  sc.writen("\r\n");
-
-
-  if(!htmlBody.empty()) {
-    sc.writen("This is a multi-part message in MIME format\r\n\r\n");
-
-    sc.writen("--"+sepa+"\r\n");
-    sc.writen("Content-Type: text/plain; charset=\"utf-8\"; format=\"fixed\"\r\n");
-    sc.writen("Content-Transfer-Encoding: quoted-printable\r\n\r\n");
-  }
-  string qp = toQuotedPrintable(textBody);
-
-  sc.writen(qp +"\r\n");
-  
-  if(htmlBody.empty()) {
-    sc.writen("\r\n.\r\n");
-    sponge(250);
-    return;
-  }
-  sc.writen("--"+sepa+"\r\n");
-
-  string sepa2 = "_"+getLargeId();
-  sc.writen("Content-Type: multipart/related; boundary=\""+sepa2+"\"\r\n\r\n");
-
-  sc.writen("--"+sepa2+"\r\n");
-  
-  sc.writen("Content-Type: text/html; charset=\"utf-8\"\r\n");
-  sc.writen("Content-Transfer-Encoding: base64\r\n\r\n");
-  int linelen = 76;
-  string b64 = base64::to_base64(htmlBody);
-  int pos = 0;
-  for(pos = 0 ; pos < (int)b64.length() - linelen; pos += linelen) {
-    sc.writen(b64.substr(pos, linelen)+"\r\n");
+  tm.tm_sec = 0;
+  tm.tm_isdst = -1; // let mktime figure out if it is summer time then
+  time_t ret = mktime(&tm);
+  if(timeonly && ret <= now) {
+    tm.tm_mday++; // mktime normalizes this, also at the end of the month
+    tm.tm_isdst = -1;
+    ret = mktime(&tm);
   }
-  sc.writen(b64.substr(pos) +"\r\n");
-  // perhaps another empty line?
-
-  for(const auto& [id, fname] : att) {
-    sc.writen("--"+sepa2+"\r\n");
-    string type="jpeg";
-    if(endsWith(fname, ".png"))
-      type="png";
-    else if(endsWith(fname, ".webp"))
-      type="webp";
-    
-    sc.writen("Content-Type: image/"+type+"; name=\""+fname+"\"\r\n");
-    sc.writen("Content-Disposition: inline; filename=\""+fname+"\"\r\n");
-    sc.writen("Content-Id: <" + id+ ">\r\n");
-    sc.writen("Content-Transfer-Encoding: base64\r\n\r\n");
-    b64 = base64::to_base64(getContentsOfFile(fname));
-    for(pos = 0 ; pos < (int)b64.length() - linelen; pos += linelen) {
-      sc.writen(b64.substr(pos, linelen)+"\r\n");
-    }
-    sc.writen(b64.substr(pos) +"\r\n");
-  }
-  
-  sc.writen("--"+sepa2+"--\r\n\r\n");
-  sc.writen("--"+sepa+"--\r\n.\r\n");
-  sponge(250);
-  return;
+  return ret;
 }
 
-
 std::string htmlEscape(const std::string& data)
 {
   std::string buffer;
@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <string_view>
+#include <ctime>
 #include <variant>
 #include <unordered_map>
 #include <set>
@@ -11,12 +13,16 @@ std::string getLargeId();
 std::vector<std::pair<uint32_t, std::unordered_map<std::string, std::string>>> imapGetMessages(const ComboAddress& server, const std::string& user, const std::string& password);
 void imapMove(const ComboAddress& server, const std::string& user, const std::string& password, const std::set<uint32_t>& uids);
 std::string getContentsOfFile(const std::string& fname);
+std::string toQuotedPrintable(const std::string& in);
+void appendQuotedPrintable(std::string& out, std::string_view in);
+void appendBase64Lines(std::string& out, std::string_view in);
 std::string htmlEscape(const std::string& data);
 std::string urlEscape(const std::string& data);
 std::vector<std::string> splitString(const std::string& str, const std::string& delimiter);
 std::string concatUrl(const std::string& a, const std::string& b);
 void replaceSubstring(std::string &originalString, const std::string &searchString, const std::string &replaceString);
 bool endsWith(const std::string& str, const std::string& suffix);
+time_t parseLocalTime(const std::string& str, time_t now);
 template<typename T, typename R>
 R genget(const T& cont, const std::string& fname)
 {
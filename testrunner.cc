@@ -1,17 +1,34 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <algorithm> // std::move() and friends
 #include <stdexcept>
+#include <set>
 #include <string>
 #include <thread>
 #include <unistd.h> //unlink(), usleep()
+#include <signal.h>
 #include <unordered_map>
 #include "doctest.h"
 #include <chrono>
+#include <filesystem>
 #include <fmt/chrono.h>
 #include <fmt/printf.h>
 #include "nlohmann/json.hpp"
 
 #include "support.hh"
+#include "ratelimit.hh"
+#include "relaypool.hh"
+#include "mime.hh"
+#include "latency.hh"
+#include "dkim.hh"
+#include "spool.hh"
+#include "smtp.hh"
+#include "smtpsink.hh"
+#include "smtpengine.hh"
+#include "queuerunner.hh"
+#include "statuswriter.hh"
+#include "base64.hpp"
+#include <openssl/evp.h>
+#include <openssl/pem.h>
 
 using namespace std;
 
@@ -23,3 +40,827 @@ TEST_CASE("concat test") {
   CHECK(concatUrl("https://berthub.eu", "") == "https://berthub.eu");
   CHECK(concatUrl("https://berthub.eu/", "") == "https://berthub.eu/");
 }
+
+TEST_CASE("quoted printable") {
+  CHECK(toQuotedPrintable("Hello. World=yes \nline two\t\n.dot start\nna\xc3\xafve") ==
+	"Hello. World=3Dyes=20\r\nline two=09\r\n=2Edot start\r\nna=C3=AFve");
+  CHECK(toQuotedPrintable("windows\r\nlines\r") == "windows\r\nlines=0D");
+
+  string in(200, 'a');
+  in[75] = '.';
+  string out = toQuotedPrintable(in);
+  for(const auto& line : splitString(out, "\r\n")) {
+    CHECK(line.size() <= 76);
+    CHECK(line[0] != '.');
+  }
+  CHECK(out.substr(0, 77) == string(75, 'a') + "=\r");
+  CHECK(out.substr(77, 4) == "\n=2E");
+}
+
+TEST_CASE("base64 lines") {
+  string out;
+  appendBase64Lines(out, "");
+  CHECK(out == "");
+  appendBase64Lines(out, "hoi");
+  CHECK(out == "aG9p\r\n");
+  out.clear();
+  appendBase64Lines(out, "ho");
+  CHECK(out == "aG8=\r\n");
+
+  string in;
+  for(int n = 0; n < 1000; ++n)
+    in.push_back(n * 7);
+  for(size_t len : {56, 57, 58, 114, 1000}) {
+    out.clear();
+    appendBase64Lines(out, string_view(in).substr(0, len));
+    string b64 = base64::to_base64(in.substr(0, len)), expected;
+    for(size_t pos = 0; pos < b64.size(); pos += 76)
+      expected += b64.substr(pos, 76) + "\r\n";
+    CHECK(out == expected);
+  }
+}
+
+// run with: testrunner --no-skip
+TEST_CASE("encoder benchmark" * doctest::skip()) {
+  string prose;
+  while(prose.size() < 1000000)
+    prose += "The quick brown fox jumps over the lazy dog. Really, it does. Caf\xc3\xa9 = bar.\n";
+
+  auto start = std::chrono::steady_clock::now();
+  size_t total = 0;
+  const int rounds = 50;
+  for(int n = 0; n < rounds; ++n)
+    total += toQuotedPrintable(prose).size();
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+  fmt::print("quoted printable: {:.0f} MB/s, {:.2f}x expansion\n", rounds * prose.size() / took.count() / 1000000, 1.0 * total / rounds / prose.size());
+
+  start = std::chrono::steady_clock::now();
+  for(int n = 0; n < rounds; ++n) {
+    string out;
+    appendBase64Lines(out, prose);
+    total += out.size();
+  }
+  took = std::chrono::steady_clock::now() - start;
+  fmt::print("base64 lines: {:.0f} MB/s\n", rounds * prose.size() / took.count() / 1000000);
+  CHECK(total > 0);
+}
+
+TEST_CASE("large id") {
+  set<string> seen;
+  for(int n = 0; n < 10000; ++n) {
+    string id = getLargeId();
+    CHECK(id.size() == 22);
+    CHECK(id.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_") == string::npos);
+    CHECK(seen.insert(id).second);
+  }
+  CHECK(getRandom64() != getRandom64());
+}
+
+// run with: testrunner --no-skip
+TEST_CASE("id benchmark" * doctest::skip()) {
+  const int rounds = 1000000;
+  auto start = std::chrono::steady_clock::now();
+  size_t total = 0;
+  for(int n = 0; n < rounds; ++n)
+    total += getLargeId()[0];
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+  fmt::print("getLargeId: {:.1f} M ids/s\n", rounds / took.count() / 1000000);
+
+  vector<std::thread> threads;
+  start = std::chrono::steady_clock::now();
+  for(int t = 0; t < 8; ++t)
+    threads.emplace_back([]() {
+      for(int n = 0; n < rounds / 8; ++n)
+	getLargeId();
+    });
+  for(auto& t : threads)
+    t.join();
+  took = std::chrono::steady_clock::now() - start;
+  fmt::print("getLargeId from 8 threads: {:.1f} M ids/s\n", rounds / took.count() / 1000000);
+  CHECK(total > 0);
+}
+
+TEST_CASE("parse local time") {
+  time_t now = time(0);
+  time_t t = parseLocalTime("07:00", now);
+  CHECK(t > now);
+  CHECK(t <= now + 25 * 3600); // a day can be 25 hours when summer time ends
+  struct tm tm={0};
+  localtime_r(&t, &tm);
+  CHECK(tm.tm_hour == 7);
+  CHECK(tm.tm_min == 0);
+
+  t = parseLocalTime("2026-10-18 07:30", now);
+  localtime_r(&t, &tm);
+  CHECK(tm.tm_year == 126);
+  CHECK(tm.tm_mon == 9);
+  CHECK(tm.tm_mday == 18);
+  CHECK(tm.tm_hour == 7);
+  CHECK(tm.tm_min == 30);
+
+  CHECK_THROWS(parseLocalTime("tomorrow", now));
+  CHECK_THROWS(parseLocalTime("07:00 sharp", now));
+}
+
+TEST_CASE("token bucket") {
+  TokenBucket tb(2, 3);
+  CHECK(tb.tryTake(0) == 0);
+  CHECK(tb.tryTake(0) == 0);
+  CHECK(tb.tryTake(0) == 0);
+  CHECK(tb.tryTake(0) == doctest::Approx(0.5));
+  CHECK(tb.tryTake(0.5) == 0);
+  CHECK(tb.tryTake(0.5) == doctest::Approx(0.5));
+  CHECK(tb.tryTake(100) == 0); // refilled, but not beyond the burst
+  CHECK(tb.tryTake(100) == 0);
+  CHECK(tb.tryTake(100) == 0);
+  CHECK(tb.tryTake(100) > 0);
+}
+
+TEST_CASE("domain rate limiter") {
+  CHECK(getDomain("Bert@Hubertnet.NL") == "hubertnet.nl");
+
+  DomainRateLimiter drl;
+  drl.setLimit("gmail.com", "1/2");
+  CHECK(drl.tryTake("gmail.com", 0) == 0);
+  CHECK(drl.tryTake("gmail.com", 0) == 0);
+  CHECK(drl.tryTake("gmail.com", 0) == doctest::Approx(1.0));
+  for(int n = 0; n < 10; ++n)
+    CHECK(drl.tryTake("hubertnet.nl", 0) == 0);
+
+  drl.setLimit("default", 1, 1);
+  CHECK(drl.tryTake("hubertnet.nl", 0) == 0);
+  CHECK(drl.tryTake("hubertnet.nl", 0) > 0);
+  CHECK(drl.tryTake("example.com", 0) == 0);
+  CHECK_THROWS_AS(drl.setLimit("example.com", 0, 1), std::runtime_error);
+}
+
+TEST_CASE("relay pool") {
+  RelayPool rp("10.0.0.1, 10.0.0.2:587*2", 2, 10);
+  REQUIRE(rp.size() == 2);
+  CHECK(rp.getAddress(0).toStringWithPort() == "10.0.0.1:25");
+  CHECK(rp.getAddress(1).toStringWithPort() == "10.0.0.2:587");
+
+  // sessions are spread by weight
+  vector<size_t> got;
+  for(int n = 0; n < 3; ++n)
+    got.push_back(rp.acquire(0));
+  CHECK(count(got.begin(), got.end(), 0) == 1);
+  CHECK(count(got.begin(), got.end(), 1) == 2);
+
+  // two failures eject the relay, and new sessions avoid it
+  rp.reportFailure(1, 0);
+  CHECK(rp.acquire(0) == 1);
+  rp.reportFailure(1, 0);
+  CHECK(rp.acquire(1) == 0);
+  CHECK(rp.acquire(9) == 0);
+
+  // after the ejection, one probe is allowed
+  CHECK(rp.acquire(10) == 1);
+  CHECK(rp.acquire(10) == 0);
+  rp.reportSuccess(1);
+  CHECK(rp.acquire(10) == 1);
+
+  CHECK_THROWS_AS(RelayPool(""), std::runtime_error);
+  CHECK_THROWS_AS(RelayPool("10.0.0.1*0"), std::runtime_error);
+}
+
+TEST_CASE("mime buffers") {
+  MIMEBuffers mb;
+  string big(200000, 'x'); // more than a pipe holds, so writev has to be partial
+  mb.append("From: ");
+  mb.appendf("{}\r\n", "bert@hubertnet.nl");
+  mb.reference(big);
+  mb.append("\r\n.\r\n");
+  CHECK(mb.getIOVecs().size() == 3);
+  CHECK(mb.size() == 25 + big.size() + 5);
+
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  std::thread t([&]() {
+    mb.writeTo(fds[1], 1);
+    close(fds[1]);
+  });
+  string got;
+  char buf[4096];
+  ssize_t len;
+  while((len = read(fds[0], buf, sizeof(buf))) > 0)
+    got.append(buf, len);
+  t.join();
+  close(fds[0]);
+  CHECK(got == "From: bert@hubertnet.nl\r\n" + big + "\r\n.\r\n");
+}
+
+TEST_CASE("pipelined replies") {
+  signal(SIGPIPE, SIG_IGN);
+  SMTPSink sink(ComboAddress("127.0.0.1", 0), SMTPSinkSettings());
+  sink.start();
+  SMTPSession session(sink.getLocal().toStringWithPort());
+  auto send = [&](const string& to) {
+    session.sendEmail("bert@hubertnet.nl", to, "Hi", "Hello", "<p>Hello</p>");
+  };
+
+  // MAIL, RCPT and DATA go out in one write, and get 250, 550 and 554
+  try {
+    send("permfail@example.com");
+    CHECK(false);
+  }
+  catch(SMTPError& e) {
+    CHECK(e.d_code == 550);
+    CHECK(string(e.what()).find("RCPT To:<permfail@example.com>") != string::npos);
+  }
+  // we read the 554 too, so the next message gets its own replies
+  send("you@example.com");
+  CHECK(session.getNumSent() == 1);
+  try {
+    send("tempfail@example.com");
+    CHECK(false);
+  }
+  catch(SMTPError& e) {
+    CHECK(e.d_code == 451);
+  }
+  send("them@example.com");
+  CHECK(session.getNumSent() == 2);
+  CHECK(sink.getNumMessages() == 2);
+  CHECK(sink.getNumRejected() == 2);
+}
+
+TEST_CASE("relay failover") {
+  signal(SIGPIPE, SIG_IGN);
+  SMTPSink sink(ComboAddress("127.0.0.1", 0), SMTPSinkSettings());
+  sink.start();
+  // nothing listens on port 1, and the dead relay comes first, so it also wins the tie in acquire()
+  auto pool = std::make_shared<RelayPool>("127.0.0.1:1, " + sink.getLocal().toStringWithPort());
+  {
+    SMTPSession session(pool);
+    session.sendEmail("bert@hubertnet.nl", "you@example.com", "Hi", "Hello", "<p>Hello</p>");
+    CHECK(session.getRelay() == sink.getLocal().toStringWithPort());
+  }
+  CHECK(sink.getNumMessages() == 1);
+
+  // with nowhere to go, it is not the message's fault
+  SMTPSession dead("127.0.0.1:1");
+  bool threw = false;
+  try {
+    dead.sendEmail("bert@hubertnet.nl", "you@example.com", "Hi", "Hello", "<p>Hello</p>");
+  }
+  catch(SMTPError&) {
+    CHECK(false);
+  }
+  catch(std::exception&) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+TEST_CASE("session recycling") {
+  signal(SIGPIPE, SIG_IGN);
+  SMTPSinkSettings ss;
+  ss.idleMsec = 200;
+  SMTPSink sink(ComboAddress("127.0.0.1", 0), ss), other(ComboAddress("127.0.0.1", 0), SMTPSinkSettings());
+  sink.start();
+  other.start();
+  string first = sink.getLocal().toStringWithPort();
+  auto pool = std::make_shared<RelayPool>(first + ", " + other.getLocal().toStringWithPort(), 1); // ejected after a single failure
+  SMTPSession session(pool);
+  session.setRecycle(2, 3600);
+  auto send = [&]() {
+    session.sendEmail("bert@hubertnet.nl", "you@example.com", "Hi", "Hello", "<p>Hello</p>");
+  };
+  for(int n = 0; n < 3; ++n)
+    send();
+  CHECK(session.getRelay() == first);
+  CHECK(sink.getPhaseStats()["setup"].at(4) == 2); // a new connection for the third message
+
+  // the sink says 421 to our idle connection, which is no reason to eject it and move to the other relay
+  usleep(500000);
+  send();
+  CHECK(session.getNumSent() == 4);
+  CHECK(session.getRelay() == first);
+  CHECK(other.getNumMessages() == 0);
+}
+
+TEST_CASE("smtp engine") {
+  signal(SIGPIPE, SIG_IGN);
+  // runs the recipients through an engine, and returns the code each one got, 250 for success
+  auto runAll = [](std::shared_ptr<RelayPool> pool, unsigned int sessions, const vector<string>& rcpts) {
+    SMTPEngine engine(pool, sessions, 2);
+    engine.setRecycle(5, 3600);
+    vector<int> codes(rcpts.size(), -1);
+    size_t n = 0;
+    engine.run([&](SMTPJob& job, unsigned int, double& wait) {
+      if(n == rcpts.size()) {
+        wait = -1;
+        return false;
+      }
+      job.envelopeFrom = "bert@hubertnet.nl";
+      job.to = rcpts[n];
+      job.msg.append("Subject: hi\r\n\r\nHello\r\n");
+      job.id = n++;
+      return true;
+    }, [&](SMTPJob& job, int code, const std::string& error) {
+      codes.at(job.id) = error.empty() ? 250 : code;
+    });
+    CHECK(engine.getNumSent() == (uint64_t)count(codes.begin(), codes.end(), 250));
+    return codes;
+  };
+
+  for(bool pipelining : {true, false}) {
+    SMTPSinkSettings ss;
+    ss.pipelining = pipelining;
+    SMTPSink sink(ComboAddress("127.0.0.1", 0), ss);
+    sink.start();
+    auto pool = std::make_shared<RelayPool>(sink.getLocal().toStringWithPort());
+    vector<string> rcpts;
+    for(int n = 0; n < 20; ++n)
+      rcpts.push_back(fmt::format("you{}@example.com", n));
+    rcpts[3] = "tempfail@example.com";
+    rcpts[7] = "permfail@example.com";
+    rcpts[11] = "hangup@example.com";
+    rcpts[15] = "bad<address@example.com";
+    auto codes = runAll(pool, 2, rcpts);
+    for(size_t n = 0; n < codes.size(); ++n) {
+      if(n == 3)
+        CHECK(codes[n] == 451);
+      else if(n == 7)
+        CHECK(codes[n] == 550);
+      else if(n == 11)
+        CHECK(codes[n] == 0); // a hangup after the message is not retried, it may have been delivered
+      else if(n == 15)
+        CHECK(codes[n] == 553); // permanent, no use trying that again
+      else
+        CHECK(codes[n] == 250);
+    }
+    // the rejected recipients did not mess up the sessions, and the one that hung up reconnected
+    CHECK(sink.getNumMessages() == 16);
+    CHECK(sink.getPhaseStats()["setup"].at(4) >= 4); // two sessions reconnect after 5 messages each
+  }
+}
+
+TEST_CASE("smtp engine slow ack") {
+  signal(SIGPIPE, SIG_IGN);
+  SMTPSinkSettings ss;
+  ss.ackMsec = 500;
+  SMTPSink sink(ComboAddress("127.0.0.1", 0), ss);
+  sink.start();
+  auto pool = std::make_shared<RelayPool>(sink.getLocal().toStringWithPort());
+  for(double ackTimeout : {600.0, 0.2}) {
+    SMTPEngine engine(pool, 1, 0.2);
+    engine.setAckTimeout(ackTimeout);
+    int n = 0, code = -1;
+    engine.run([&](SMTPJob& job, unsigned int, double& wait) {
+      if(n++) {
+        wait = -1;
+        return false;
+      }
+      job.envelopeFrom = "bert@hubertnet.nl";
+      job.to = "you@example.com";
+      job.msg.append("Subject: hi\r\n\r\nHello\r\n");
+      return true;
+    }, [&](SMTPJob&, int c, const std::string& error) {
+      code = error.empty() ? 250 : c;
+    });
+    // the regular timeout does not apply to the ack, and if we do give up on it, we do not send it again
+    CHECK(code == (ackTimeout > 1 ? 250 : 0));
+  }
+  usleep(500000); // until the sink got to the second one
+  CHECK(sink.getNumMessages() == 2);
+}
+
+TEST_CASE("smtp engine idle sessions") {
+  signal(SIGPIPE, SIG_IGN);
+  SMTPSinkSettings ss;
+  ss.idleMsec = 200;
+  SMTPSink sink(ComboAddress("127.0.0.1", 0), ss), other(ComboAddress("127.0.0.1", 0), SMTPSinkSettings());
+  sink.start();
+  other.start();
+  auto pool = std::make_shared<RelayPool>(sink.getLocal().toStringWithPort() + ", " + other.getLocal().toStringWithPort(), 1);
+  SMTPEngine engine(pool, 2, 2);
+  int sent = 0, failed = 0, asked = 0;
+  auto start = std::chrono::steady_clock::now();
+  double sleepUntil = 0;
+  engine.run([&](SMTPJob& job, unsigned int session, double& wait) {
+    double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    // session 1 never gets anything, which must not slow down session 0
+    if(session == 1 || now < sleepUntil) {
+      wait = session == 1 ? 0.25 : sleepUntil - now;
+      return false;
+    }
+    if(asked == 40) {
+      wait = -1;
+      return false;
+    }
+    // halfway, we go quiet for long enough for the sink to hang up on us
+    if(++asked == 20)
+      sleepUntil = now + 0.5;
+    job.envelopeFrom = "bert@hubertnet.nl";
+    job.to = "you@example.com";
+    job.msg.append("Subject: hi\r\n\r\nHello\r\n");
+    return true;
+  }, [&](SMTPJob&, int, const std::string& error) {
+    if(error.empty())
+      sent++;
+    else
+      failed++;
+  });
+  double took = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  CHECK(sent == 40);
+  CHECK(failed == 0);
+  CHECK(took < 2);
+  // the 421 to the idle session did not eject the relay
+  CHECK(sink.getNumMessages() == 40);
+  CHECK(other.getNumMessages() == 0);
+}
+
+// a scratch database with the tables QueueRunner uses, and a message for the queue rows
+static string makeQueueDB()
+{
+  char tmpl[] = "/tmp/ckmqueue-XXXXXX";
+  if(!mkdtemp(tmpl))
+    throw std::runtime_error("Could not create scratch directory");
+  string fname = string(tmpl) + "/queue.sqlite3";
+  SQLiteWriter db(fname, SQLWFlag::NoTransactions);
+  db.addValue({{"id", "m1"}, {"textversion", "Hello {{ channelName }}"}, {"htmlversion", "<p>Hello {{ channelName }}</p>"}}, "msgs");
+  db.addValue({{"id", ""}, {"msgId", ""}, {"filename", ""}}, "attachments");
+  db.queryT("delete from attachments");
+  db.addValue({{"name", ""}, {"value", ""}}, "settings");
+  db.queryT("delete from settings");
+  LatencyRecorder::initTable(db);
+  return fname;
+}
+
+static void addQueueRow(SQLiteWriter& db, const string& id, const string& destination, int priority, int64_t attempts=0, int64_t nextAttempt=time(0) - 1, const string& leaseOwner="")
+{
+  db.addValue({{"id", id}, {"msgId", "m1"}, {"launchId", "l1"}, {"subject", "Hi"}, {"sent", 0}, {"bounced", 0},
+	       {"channelId", "c1"}, {"channelName", "news"}, {"destination", destination}, {"userId", "u" + id}, {"timsi", "t" + id},
+	       {"timestamp", (int64_t)time(0)}, {"attempts", attempts}, {"nextAttempt", nextAttempt}, {"failed", 0}, {"lastError", ""},
+	       {"leaseOwner", leaseOwner}, {"leaseExpiry", leaseOwner.empty() ? 0 : (int64_t)time(0) + 300}, {"priority", priority}}, "queue");
+}
+
+static QueueRunnerSettings testQueueSettings(const SMTPSink& sink)
+{
+  QueueRunnerSettings qrs;
+  qrs.smtpServer = sink.getLocal().toStringWithPort();
+  qrs.senderEmail = "bert@hubertnet.nl";
+  qrs.statusMsec = 50;
+  qrs.verbose = false;
+  return qrs;
+}
+
+TEST_CASE("queue runners share a queue") {
+  signal(SIGPIPE, SIG_IGN);
+  SMTPSinkSettings ss;
+  ss.keepRecipients = true;
+  SMTPSink sink(ComboAddress("127.0.0.1", 0), ss);
+  sink.start();
+  string fname = makeQueueDB();
+  {
+    SQLiteWriter db(fname, SQLWFlag::NoTransactions);
+    for(int n = 0; n < 300; ++n)
+      addQueueRow(db, fmt::format("q{}", n), fmt::format("user{}@example{}.com", n, n % 7), QueueRunner::Bulk);
+  }
+  // two runners, like two processes, each with its own connection and workers, claiming small batches
+  SQLiteWriter db1(fname, SQLWFlag::NoTransactions), db2(fname, SQLWFlag::NoTransactions);
+  auto qrs = testQueueSettings(sink);
+  qrs.numWorkers = 3;
+  qrs.fetchBatch = 10;
+  QueueRunner qr1(db1, qrs), qr2(db2, qrs);
+  std::thread t([&]() { qr1.run(); });
+  qr2.run();
+  t.join();
+
+  auto rcpts = sink.getRecipients();
+  CHECK(rcpts.size() == 300);
+  CHECK(set<string>(rcpts.begin(), rcpts.end()).size() == 300); // nobody got it twice
+  auto res = db1.queryT("select count(1) filter (where sent=1) sent, count(distinct leaseOwner) owners from queue");
+  CHECK(iget(res.at(0), "sent") == 300);
+  CHECK(iget(res.at(0), "owners") == 2); // both did their share
+  std::filesystem::remove_all(std::filesystem::path(fname).parent_path());
+}
+
+TEST_CASE("queue runner retries") {
+  signal(SIGPIPE, SIG_IGN);
+  SMTPSink sink(ComboAddress("127.0.0.1", 0), SMTPSinkSettings());
+  sink.start();
+  string fname = makeQueueDB();
+  SQLiteWriter db(fname, SQLWFlag::NoTransactions);
+  addQueueRow(db, "ok", "you@example.com", QueueRunner::Bulk);
+  addQueueRow(db, "temp", "tempfail@example.com", QueueRunner::Bulk);
+  addQueueRow(db, "temp4", "tempfail4@example.com", QueueRunner::Bulk, 3);
+  addQueueRow(db, "perm", "permfail@example.com", QueueRunner::Bulk);
+  addQueueRow(db, "last", "tempfail10@example.com", QueueRunner::Bulk, 9);
+  auto qrs = testQueueSettings(sink);
+  qrs.retryBase = 60;
+  qrs.retryMax = 3600;
+  qrs.maxAttempts = 10;
+  time_t now = time(0);
+  {
+    QueueRunner qr(db, qrs);
+    qr.run();
+  }
+  auto get = [&](const string& id) {
+    return db.queryT("select sent, failed, attempts, nextAttempt, leaseOwner, lastError from queue where id=?", {id}).at(0);
+  };
+  CHECK(iget(get("ok"), "sent") == 1);
+
+  // a 451 comes back after retryBase, doubling with every attempt, and the lease is released
+  auto r = get("temp");
+  CHECK(iget(r, "sent") == 0);
+  CHECK(iget(r, "failed") == 0);
+  CHECK(iget(r, "attempts") == 1);
+  CHECK(iget(r, "nextAttempt") >= now + 60);
+  CHECK(iget(r, "nextAttempt") <= time(0) + 60);
+  CHECK(eget(r, "leaseOwner").empty());
+  CHECK(eget(r, "lastError").find("451") != string::npos);
+  r = get("temp4");
+  CHECK(iget(r, "attempts") == 4);
+  CHECK(iget(r, "nextAttempt") >= now + 480);
+  CHECK(iget(r, "nextAttempt") <= time(0) + 480);
+
+  // a 550 is the end of it, and so is running out of attempts
+  r = get("perm");
+  CHECK(iget(r, "failed") == 1);
+  CHECK(iget(r, "attempts") == 1);
+  r = get("last");
+  CHECK(iget(r, "failed") == 1);
+  CHECK(iget(r, "attempts") == 10);
+  std::filesystem::remove_all(std::filesystem::path(fname).parent_path());
+}
+
+TEST_CASE("status writer leases") {
+  string fname = makeQueueDB();
+  SQLiteWriter db(fname, SQLWFlag::NoTransactions);
+  addQueueRow(db, "mine", "you@example.com", QueueRunner::Bulk, 0, 0, "me");
+  addQueueRow(db, "taken", "them@example.com", QueueRunner::Bulk, 0, 0, "other"); // our lease expired, and another runner claimed it
+  addQueueRow(db, "failed", "us@example.com", QueueRunner::Bulk, 0, 0, "me");
+  {
+    StatusWriter sw(db, "me", 100, 1000);
+    sw.markSent("mine");
+    sw.markSent("taken");
+    sw.markFailed("failed", 1, time(0) + 60, false, "451 later");
+    sw.markFailed("taken", 1, time(0) + 60, true, "550 no");
+    sw.flush();
+  }
+  auto get = [&](const string& id) {
+    return db.queryT("select sent, failed, attempts, leaseOwner from queue where id=?", {id}).at(0);
+  };
+  CHECK(iget(get("mine"), "sent") == 1);
+  auto r = get("taken"); // neither outcome was ours to write
+  CHECK(iget(r, "sent") == 0);
+  CHECK(iget(r, "failed") == 0);
+  CHECK(iget(r, "attempts") == 0);
+  CHECK(eget(r, "leaseOwner") == "other");
+  r = get("failed");
+  CHECK(iget(r, "attempts") == 1);
+  CHECK(eget(r, "leaseOwner").empty());
+  std::filesystem::remove_all(std::filesystem::path(fname).parent_path());
+}
+
+TEST_CASE("queue lanes") {
+  signal(SIGPIPE, SIG_IGN);
+  SMTPSinkSettings ss;
+  ss.keepRecipients = true;
+  SMTPSink sink(ComboAddress("127.0.0.1", 0), ss);
+  sink.start();
+  string fname = makeQueueDB();
+  SQLiteWriter db(fname, SQLWFlag::NoTransactions);
+  // the bulk rows are older, and came first, but the higher lanes go first anyway
+  for(int n = 0; n < 3; ++n)
+    addQueueRow(db, fmt::format("b{}", n), fmt::format("bulk{}@example.com", n), QueueRunner::Bulk, 0, time(0) - 100);
+  addQueueRow(db, "t", "test@example.com", QueueRunner::Test);
+  addQueueRow(db, "l", "login@example.com", QueueRunner::Transactional);
+  auto qrs = testQueueSettings(sink);
+  qrs.reservedWorkers = 0;
+  {
+    QueueRunner qr(db, qrs);
+    qr.run();
+  }
+  CHECK(sink.getRecipients() == vector<string>({"login@example.com", "test@example.com", "bulk0@example.com", "bulk1@example.com", "bulk2@example.com"}));
+  std::filesystem::remove_all(std::filesystem::path(fname).parent_path());
+}
+
+TEST_CASE("maildir spool") {
+  char tmpl[] = "/tmp/ckmspool-XXXXXX";
+  REQUIRE(mkdtemp(tmpl));
+  string dir = tmpl;
+  auto ls = [&](const string& sub) {
+    set<string> ret;
+    for(const auto& e : std::filesystem::directory_iterator(dir + "/" + sub))
+      ret.insert(e.path().filename());
+    return ret;
+  };
+  {
+    MaildirSpool spool(dir);
+    MIMEBuffers mb;
+    mb.append("Subject: hi\r\n\r\nHello\r\n");
+    spool.add("q1", "bmailer+q1@hubertnet.nl", "you@example.com", mb);
+    spool.add("q2", "bmailer+q2@hubertnet.nl", "them@example.com", mb);
+    CHECK(spool.size() == 2);
+    CHECK(ls("tmp").size() == 4);
+    CHECK(ls("new").empty()); // not visible to the MTA yet
+    spool.commit();
+    CHECK(spool.size() == 0);
+  }
+  CHECK(ls("tmp").empty());
+  auto msgs = ls("new");
+  REQUIRE(msgs.size() == 2);
+  CHECK(ls("env") == msgs);
+  string name = *msgs.begin();
+  CHECK(name.find(".q1.") != string::npos);
+  CHECK(getContentsOfFile(dir + "/new/" + name) == "Subject: hi\r\n\r\nHello\r\n");
+  CHECK(getContentsOfFile(dir + "/env/" + name) == "envelope-from bmailer+q1@hubertnet.nl\nrecipient you@example.com\n");
+
+  // what was not committed does not get delivered
+  {
+    MaildirSpool spool(dir);
+    MIMEBuffers mb;
+    mb.append("Subject: hi\r\n\r\nHello\r\n");
+    spool.add("q3", "bmailer+q3@hubertnet.nl", "you@example.com", mb);
+    CHECK(ls("tmp").size() == 2);
+  }
+  CHECK(ls("tmp").empty());
+  CHECK(ls("new") == msgs);
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("latency histogram") {
+  CHECK(LatencyHistogram::getBucket(0) == 0);
+  CHECK(LatencyHistogram::getBucket(1.5) == 0);
+  CHECK(LatencyHistogram::getBucket(2) == 1);
+  CHECK(LatencyHistogram::getBucket(1000) == 9);
+  CHECK(LatencyHistogram::getBucket(1e12) == LatencyHistogram::numBuckets - 1);
+
+  LatencyHistogram h;
+  CHECK(h.getPercentile(0.5) == 0);
+  for(int n = 0; n < 90; ++n)
+    h.add(100);   // bucket 6, 64-128
+  for(int n = 0; n < 10; ++n)
+    h.add(5000);  // bucket 12, 4096-8192
+  CHECK(h.getCount() == 100);
+  CHECK(h.getPercentile(0.5) == 128);
+  CHECK(h.getPercentile(0.9) == 128);
+  CHECK(h.getPercentile(0.91) == 8192);
+  CHECK(h.getPercentile(1) == 8192);
+}
+
+static std::string makeRSAKey(int bits)
+{
+  std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(EVP_RSA_gen(bits), EVP_PKEY_free);
+  std::unique_ptr<BIO, decltype(&BIO_free)> bio(BIO_new(BIO_s_mem()), BIO_free);
+  PEM_write_bio_PrivateKey(bio.get(), key.get(), nullptr, nullptr, 0, nullptr, nullptr);
+  char* ptr;
+  long len = BIO_get_mem_data(bio.get(), &ptr);
+  return string(ptr, len);
+}
+
+// checks a DKIM-Signature the way a receiver would, only relying on the canonicalization helpers
+static bool verifyDKIM(const string& msg, const string& pem)
+{
+  size_t end = msg.find("\r\n\r\n");
+  if(end == string::npos)
+    return false;
+  vector<string> fields; // continuation lines start with whitespace
+  for(size_t pos = 0; pos < end + 2; ) {
+    size_t eol = msg.find("\r\n", pos) + 2;
+    if(msg[pos] == ' ' || msg[pos] == '\t')
+      fields.back() += msg.substr(pos, eol - pos);
+    else
+      fields.push_back(msg.substr(pos, eol - pos));
+    pos = eol;
+  }
+  auto name = [](const string& field) {
+    string ret = DKIMSigner::relaxedHeader(field);
+    return ret.substr(0, ret.find(':'));
+  };
+  auto sig = find_if(fields.begin(), fields.end(), [&](const auto& f) { return name(f) == "dkim-signature"; });
+  if(sig == fields.end())
+    return false;
+  string flat;
+  for(char c : sig->substr(sig->find(':') + 1))
+    if(!isspace(c))
+      flat += c;
+  auto tag = [&](const string& t) {
+    auto pos = (";" + flat).find(";" + t + "=");
+    if(pos == string::npos)
+      return string();
+    pos += t.size() + 1;
+    return flat.substr(pos, flat.find(';', pos) - pos);
+  };
+  if(tag("a") != "rsa-sha256" || tag("c") != "relaxed/simple" || tag("bh") != DKIMSigner::getBodyHash({string_view(msg).substr(end + 4)}))
+    return false;
+
+  // the last instance of every header in h=, and then the signature itself, with an empty b= and no \r\n
+  string data;
+  vector<bool> used(fields.size());
+  for(const auto& h : splitString(tag("h"), ":")) {
+    for(size_t n = fields.size(); n-- > 0;) {
+      if(!used[n] && name(fields[n]) == h) {
+	used[n] = true;
+	data += DKIMSigner::relaxedHeader(fields[n]);
+	break;
+      }
+    }
+  }
+  size_t bpos = sig->find("b=", sig->find(';', sig->find("bh="))); // b= comes last
+  string empty = DKIMSigner::relaxedHeader(sig->substr(0, bpos + 2) + "\r\n");
+  data += empty.substr(0, empty.size() - 2);
+
+  string rsasig = base64::from_base64(tag("b"));
+  std::unique_ptr<BIO, decltype(&BIO_free)> bio(BIO_new_mem_buf(pem.data(), pem.size()), BIO_free);
+  std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr), EVP_PKEY_free);
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  return key && ctx && EVP_DigestVerifyInit(ctx.get(), nullptr, EVP_sha256(), nullptr, key.get()) == 1 &&
+    EVP_DigestVerify(ctx.get(), (const unsigned char*)rsasig.data(), rsasig.size(), (const unsigned char*)data.data(), data.size()) == 1;
+}
+
+TEST_CASE("dkim") {
+  // the examples from RFC 6376 3.4.5
+  CHECK(DKIMSigner::relaxedHeader("A: X\r\n") == "a:X\r\n");
+  CHECK(DKIMSigner::relaxedHeader("B : Y\t\r\n\tZ  \r\n") == "b:Y Z\r\n");
+  CHECK(DKIMSigner::getBodyHash({" C \r\nD \t E\r\n\r\n\r\n"}) == "NOeivbQlDH9TmNKJUw7D53wZfsk8YMZ/hTuVVwTgi8s=");
+  // empty lines at the end are dropped, also when they are split over pieces, and an empty body is a \r\n
+  CHECK(DKIMSigner::getBodyHash({" C \r\nD \t E\r", "\n", "\r\n", "\r\n"}) == "NOeivbQlDH9TmNKJUw7D53wZfsk8YMZ/hTuVVwTgi8s=");
+  CHECK(DKIMSigner::getBodyHash({"abc"}) == DKIMSigner::getBodyHash({"a", "bc\r\n", "\r\n"}));
+  CHECK(DKIMSigner::getBodyHash({}) == "frcCV1k9oG9oKj3dpUqdJg1PxRT2RSN/XKdLCPjaYaY=");
+  CHECK(DKIMSigner::getBodyHash({"\r\n\r\n"}) == "frcCV1k9oG9oKj3dpUqdJg1PxRT2RSN/XKdLCPjaYaY=");
+
+  CHECK_THROWS_AS(DKIMSigner("example.com", "sel", "not a key"), std::runtime_error);
+
+  string pem = makeRSAKey(2048);
+  DKIMSigner signer("hubertnet.nl", "ckm", pem);
+  string body;
+  for(int n = 0; n < 100; ++n)
+    body += "Line " + std::to_string(n) + " of a body that is referenced, not copied\r\n";
+  MIMEBuffers mb;
+  mb.append("From: Bert <bert@hubertnet.nl>\r\nTo: you@example.com\r\nSubject: first\r\n");
+  mb.append("Subject:  the   one\r\n\tthat counts\r\nX-Mailer: ckmailer\r\n");
+  mb.append("Date: Sat, 17 Oct 2026 07:00:00 +0200\r\n\r\n");
+  mb.reference(body);
+  mb.reference("\r\n\r\n");
+  signer.sign(mb, 1792220400);
+
+  string msg;
+  for(const auto& iov : mb.getIOVecs())
+    msg.append((const char*)iov.iov_base, iov.iov_len);
+  REQUIRE(msg.starts_with("DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/simple; d=hubertnet.nl; s=ckm;\r\n\tt=1792220400; h=from:to:subject:date;"));
+  string sig = msg.substr(0, msg.find("\r\nFrom:") + 2);
+  for(const auto& line : splitString(sig, "\r\n"))
+    CHECK(line.size() <= 78); // b= is folded
+  CHECK(verifyDKIM(msg, pem));
+
+  // only the last Subject is signed, and only headers in the list
+  auto changed = [&](const string& from, const string& to) {
+    string ret = msg;
+    ret.replace(ret.find(from), from.size(), to);
+    return verifyDKIM(ret, pem);
+  };
+  CHECK(changed("Subject: first", "Subject: other"));
+  CHECK(changed("X-Mailer: ckmailer", "X-Mailer: other"));
+  CHECK(changed("Subject:  the   one", "Subject: the one")); // relaxed
+  CHECK(!changed("that counts", "that matters"));
+  CHECK(!changed("Line 42", "Line 43"));
+  CHECK(!verifyDKIM(msg, makeRSAKey(2048)));
+}
+
+// run with: testrunner --no-skip
+TEST_CASE("dkim benchmark" * doctest::skip()) {
+  string text, html, img;
+  while(html.size() < 50000) {
+    text += "The quick brown fox jumps over the lazy dog. Really, it does.\n";
+    html += "<p>The quick brown fox jumps over the lazy dog. Really, it does.</p>\n";
+  }
+  for(int n = 0; n < 100000; ++n)
+    img.append(1, (char)(n * 7));
+  string fname = "/tmp/dkim-benchmark-" + getLargeId() + ".png";
+  FILE* fp = fopen(fname.c_str(), "w");
+  REQUIRE(fp);
+  fwrite(img.c_str(), 1, img.size(), fp);
+  fclose(fp);
+  vector<MailAttachment> att;
+  att.emplace_back("image1", fname);
+  unlink(fname.c_str());
+
+  MIMEBuffers mb;
+  buildMIMEMessage(mb, "bert@hubertnet.nl", "you@example.com", "Benchmark", text, html, att, {});
+  vector<std::string_view> body;
+  for(const auto& iov : mb.getIOVecs())
+    body.emplace_back((const char*)iov.iov_base, iov.iov_len);
+
+  const int rounds = 1000;
+  auto start = std::chrono::steady_clock::now();
+  for(int n = 0; n < rounds; ++n)
+    DKIMSigner::getBodyHash(body);
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+  fmt::print("dkim body hash of {} bytes: {:.1f} us/message\n", mb.size(), took.count() / rounds * 1000000);
+
+  for(int bits : {1024, 2048, 4096}) {
+    DKIMSigner signer("hubertnet.nl", "ckm", makeRSAKey(bits));
+    start = std::chrono::steady_clock::now();
+    for(int n = 0; n < rounds; ++n) {
+      MIMEBuffers copy = mb;
+      signer.sign(copy, time(0));
+    }
+    took = std::chrono::steady_clock::now() - start;
+    fmt::print("dkim signing with {} bit RSA: {:.1f} us/message\n", bits, took.count() / rounds * 1000000);
+  }
+  CHECK(mb.size() > 0);
+}